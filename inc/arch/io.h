@@ -22,6 +22,21 @@ static inline uint8_t inb(uint16_t port) {
     return __ret; 
 } 
 
+#define EFLAGS_IF 0x200
+
+static inline uint32_t read_eflags(void) {
+    uint32_t __ret;
+    __asm__ volatile("pushfd\n pop %0":"=r"(__ret));
+    return __ret;
+}
+
+// Faulting address of the last page fault.
+static inline uint32_t read_cr2(void) {
+    uint32_t __ret;
+    __asm__ volatile("mov %0, cr2":"=r"(__ret));
+    return __ret;
+}
+
 static inline void write_serial(char a) {
 loop_thr:
     asm goto("in al,dx\ntest al,cl\njz %l2"::"d"(0x3F8 + 5),"c"(0x20):"al":loop_thr);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+#define PCI_REG_COMMAND 0x04
+#define PCI_REG_CLASS   0x08
+#define PCI_REG_BAR0    0x10
+#define PCI_REG_BAR4    0x20
+
+#define PCI_COMMAND_IO     0x0001
+#define PCI_COMMAND_MASTER 0x0004
+
+uint32_t pci_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void pci_write(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset,
+               uint32_t value);
+uint8_t pci_find_class(uint8_t class, uint8_t subclass, uint8_t *bus,
+                       uint8_t *slot, uint8_t *func);
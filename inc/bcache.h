@@ -0,0 +1,43 @@
+#pragma once
+
+#include "driver/driver_blk.h"
+
+#include <stdint.h>
+
+#define BCACHE_BUFS 64
+#define BCACHE_RA_MAX 64  // Default read-ahead limit in sectors.
+
+enum {
+    BCACHE_VALID = 0x1,
+    BCACHE_DIRTY = 0x2
+};
+
+// A cached run of sectors, keyed by (dev, lba, size).
+typedef struct bcache_buf {
+    drv_blk_t *dev;
+    uint64_t lba;
+    uint32_t size;  // Bytes, multiple of dev->sector_size.
+    uint32_t refs;
+    uint8_t flags;
+    uint8_t *data;
+    struct bcache_buf *hnext, *prev, *next;
+} bcache_buf_t;
+
+typedef struct {
+    uint32_t hits, misses, writebacks, readahead;
+} bcache_stats_t;
+
+extern bcache_stats_t bcache_stats;
+extern uint32_t bcache_ra_max;
+
+bcache_buf_t *bread(drv_blk_t *dev, uint64_t lba, uint32_t size);
+void brelse(bcache_buf_t *buf);
+void bdirty(bcache_buf_t *buf);
+
+uint8_t bcache_read(drv_blk_t *dev, uint64_t lba, uint32_t count,
+                    uint8_t *buf);
+uint8_t bcache_write(drv_blk_t *dev, uint64_t lba, uint32_t count,
+                     const uint8_t *buf);
+uint8_t bcache_trim(drv_blk_t *dev, uint64_t lba, uint32_t count);
+uint8_t bcache_sync(drv_blk_t *dev);
+void bcache_print_stats(void);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "drivers.h"
+
 #include <stdint.h>
 
 extern struct ide_device {
@@ -10,13 +12,50 @@ extern struct ide_device {
     uint16_t Signature;     // Drive Signature
     uint16_t Capabilities;  // Features.
     uint32_t CommandSets;   // Command Sets Supported.
-    uint32_t Size;          // Size in Sectors.
+    uint8_t Dma;            // 1 if Bus Master DMA can be used.
+    uint8_t Multiple;       // Sectors per DRQ block in PIO.
+    uint8_t Io32;           // 1 if data port accepts 32-bit transfers.
+    uint8_t Trim;           // 1 if sectors can be discarded by DSM TRIM.
+    uint64_t Size;          // Size in Sectors.
+    uint16_t SectorSize;    // 512 for ATA, 2048 for CD/DVD.
     uint8_t Model[41];      // Model in string.
 } ide_devices[4];
 
+extern drv_blk_t ide_blk[4];
+
+// Directions:
+#define ATA_READ  0x00
+#define ATA_WRITE 0x01
+// Non-data commands, never merged or reordered:
+#define ATA_FLUSH    0x02
+#define ATA_FEATURES 0x03  // SET FEATURES, subcommand in lba.
+#define ATA_TRIM     0x04  // DATA SET MANAGEMENT, count blocks of ranges.
+
+// Block request, owned by the caller until done is set. Requests for
+// adjacent sectors are merged into one command by the channel queue.
+typedef struct ide_request {
+    uint8_t direction;  // ATA_READ, ATA_WRITE or a non-data command.
+    uint8_t drive;
+    volatile uint8_t done;
+    volatile uint8_t err;
+    uint64_t lba;
+    uint32_t count;  // Sectors of SectorSize, at most ide_max_sectors().
+    uint8_t *buf;
+    void (*callback)(struct ide_request *req);  // Called from IRQ context.
+    void *arg;
+    struct ide_request *next;    // Channel queue link.
+    struct ide_request *merged;  // Next request in the same command.
+} ide_request_t;
+
 void ide_initialize(uint16_t BAR0, uint16_t BAR1, uint16_t BAR2, uint16_t BAR3,
                     uint16_t BAR4);
-uint8_t ide_read_sectors(uint8_t drive, uint8_t numsects, uint32_t lba,
+uint8_t ide_read_sectors(uint8_t drive, uint32_t numsects, uint64_t lba,
                          uint8_t *buf);
-uint8_t ide_write_sectors(uint8_t drive, uint8_t numsects, uint32_t lba,
-                          const uint8_t *buf);
\ No newline at end of file
+uint8_t ide_write_sectors(uint8_t drive, uint32_t numsects, uint64_t lba,
+                          const uint8_t *buf);
+uint32_t ide_max_sectors(uint8_t drive);
+uint8_t ide_flush(uint8_t drive);
+uint8_t ide_trim(uint8_t drive, uint64_t lba, uint32_t count);
+uint8_t ide_write_cache(uint8_t drive, uint8_t enable);
+uint8_t ide_submit(ide_request_t *req);
+uint8_t ide_wait_request(ide_request_t *req);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+#define BLKDEV_MAX 32
+
+struct _driver_blk_t;
+
+typedef struct _driver_blk_t {
+    uint8_t (*read)(struct _driver_blk_t *drv, uint64_t lba, uint32_t count,
+                    uint8_t *buf);
+    uint8_t (*write)(struct _driver_blk_t *drv, uint64_t lba, uint32_t count,
+                     const uint8_t *buf);
+    uint8_t (*flush)(struct _driver_blk_t *drv);
+    uint8_t (*trim)(struct _driver_blk_t *drv, uint64_t lba, uint32_t count);
+    uint32_t sector_size;  // Bytes.
+    uint64_t size;         // Sectors.
+    const char *name;
+    uint64_t ra_next;    // Read-ahead state, kept by bcache.
+    uint32_t ra_window;  // Sectors.
+    void *drv_data;
+    uint32_t user_data;
+} drv_blk_t;
+
+typedef struct {
+    uint8_t drive;  // Index in ide_devices.
+} drv_ide_data_t;
+
+typedef struct {
+    uint8_t *mem;
+    uint32_t bytes;
+} drv_ramdisk_data_t;
+
+// A partition of another block device.
+typedef struct {
+    drv_blk_t *parent;
+    uint64_t start;  // First sector on the parent.
+    uint8_t type;    // MBR type, known GPT types are mapped to these.
+    char name[16];
+} drv_part_data_t;
+
+uint8_t blkdev_register(drv_blk_t *drv);
+drv_blk_t *blkdev_find(const char *name);
+drv_blk_t *blkdev_get(uint8_t n);
+
+uint8_t blkdev_read(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                    uint8_t *buf);
+uint8_t blkdev_write(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                     const uint8_t *buf);
+uint8_t blkdev_flush(drv_blk_t *drv);
+uint8_t blkdev_trim(drv_blk_t *drv, uint64_t lba, uint32_t count);
+
+void drv_ide_blk_init(drv_blk_t *drv);
+void drv_ramdisk_init(drv_blk_t *drv);
+void drv_part_init(drv_blk_t *drv);
+
+// Registers a device for every MBR, EBR or GPT partition of dev and returns
+// how many were found.
+uint8_t part_scan(drv_blk_t *dev);
+// Whole device of a partition, 0 for anything else.
+drv_blk_t *part_parent(drv_blk_t *drv);
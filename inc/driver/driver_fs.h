@@ -1,5 +1,38 @@
 #pragma once
+#include "bcache.h"
+#include "driver/driver_blk.h"
 #include "ext2.h"
+#include "iso9660.h"
+
+#define EXT2_IND_CACHE 4  // Indirect blocks kept by the block mapping.
+#define EXT2_ICACHE    64
+#define EXT2_IHASH     32
+#define EXT2_PREALLOC  8  // Used when the superblock leaves it at 0.
+#define EXT2_TRIM_RUNS 16  // Freed block runs waiting for the next sync.
+
+typedef struct ext2_icache {
+    uint32_t ino;   // 0 when free.
+    uint32_t refs;
+    uint32_t used;  // Last use, for LRU reclaim.
+    // Blocks reserved in the bitmap for the next writes of this inode.
+    uint32_t prealloc, prealloc_count;
+    ext2_inode_t inode;
+    struct ext2_icache *hnext;
+} ext2_icache_t;
+
+#define EXT2_DCACHE 128
+#define EXT2_DHASH  64
+#define EXT2_DNAME  27  // Longer names are looked up but not cached.
+
+typedef struct ext2_dentry {
+    uint32_t parent;  // 0 when free.
+    uint32_t ino;     // 0 for a negative entry.
+    uint32_t hash;
+    uint32_t used;
+    uint8_t len;
+    char name[EXT2_DNAME];
+    struct ext2_dentry *hnext;
+} ext2_dentry_t;
 
 typedef struct __attribute__((packed)) {
     uint8_t JumpBoot[3];
@@ -30,22 +63,60 @@ typedef struct {
     uint8_t CustomDefined[32];
 } exfat_parameters_t;
 
+enum {
+    VFS_O_READ = 0x01,
+    VFS_O_WRITE = 0x02,
+    VFS_O_CREATE = 0x04,
+    VFS_O_TRUNC = 0x08,
+    VFS_O_APPEND = 0x10
+};
+
+// Sizes in block_size units, avail_blocks leaves out the reserved ones.
+typedef struct {
+    uint32_t block_size;
+    uint32_t blocks, free_blocks, avail_blocks;
+    uint32_t files, free_files;
+    uint32_t max_free_run;  // Longest free extent, 0 when unknown.
+} vfs_statfs_t;
+
+// File handles are driver defined, 0 is never a valid one. read and write
+// return the bytes transferred, the others 0 on success.
 typedef struct _driver_fs_t {
-    uint32_t (*open)(struct _driver_fs_t *drv, const char *path);
+    uint32_t (*open)(struct _driver_fs_t *drv, const char *path,
+                     uint32_t flags);
     uint32_t (*resize)(struct _driver_fs_t *drv, uint32_t file, uint32_t size);
-    uint32_t (*read)(struct _driver_fs_t *drv, uint32_t file, uint32_t sector, uint8_t *ptr);
-    uint32_t (*write)(struct _driver_fs_t *drv, uint32_t file, uint32_t sector, uint8_t *ptr);
-    uint32_t (*fstat)(struct _driver_fs_t *drv, uint32_t file, uint32_t *mode, uint32_t *size);
+    uint32_t (*read)(struct _driver_fs_t *drv, uint32_t file, uint32_t offset,
+                     uint8_t *ptr, uint32_t len);
+    uint32_t (*write)(struct _driver_fs_t *drv, uint32_t file, uint32_t offset,
+                      const uint8_t *ptr, uint32_t len);
+    uint32_t (*fstat)(struct _driver_fs_t *drv, uint32_t file, uint32_t *mode,
+                      uint32_t *size);
     uint32_t (*close)(struct _driver_fs_t *drv, uint32_t file);
+    uint32_t (*unlink)(struct _driver_fs_t *drv, const char *path);
+    uint32_t (*statfs)(struct _driver_fs_t *drv, vfs_statfs_t *st);
+    // Optional, grows an empty file to size bytes on one contiguous run.
+    uint32_t (*reserve)(struct _driver_fs_t *drv, uint32_t file,
+                        uint32_t size);
     void *drv_data;
     uint32_t user_data;
 } drv_fs_t;
 
 typedef struct {
+    drv_blk_t *dev;
     ext2_sb_t sb;
-    uint32_t num_bgds, fs_start, block_size, buf_block[2], bgdtbuf_block;
-    uint8_t *buf[2], ready;
-    ext2_bgdt_t *bgdtbuf;
+    uint32_t num_bgds, fs_start, block_size, desc_size, buf_block[2];
+    uint8_t *buf[2], ready, writable, sb_dirty;
+    ext2_bgdt_t *bgdt;  // All group descriptors, decoded at mount.
+    uint32_t *max_run;  // Per group, at least its longest free block run.
+    // Freed blocks not yet discarded, a count of 0 marks a free slot.
+    uint32_t trim_start[EXT2_TRIM_RUNS], trim_count[EXT2_TRIM_RUNS];
+    bcache_buf_t *bbuf[2];
+    ext2_icache_t *icache, *ihash[EXT2_IHASH];
+    ext2_dentry_t *dcache, *dhash[EXT2_DHASH];
+    uint32_t iclock, dclock;
+    bcache_buf_t *ind_buf[EXT2_IND_CACHE];
+    uint32_t ind_block[EXT2_IND_CACHE];
+    uint8_t ind_next;
 } drv_fs_ext2_data_t;
 
 typedef struct {
@@ -56,18 +127,53 @@ typedef struct {
 } drv_fs_exfat_data_t;
 
 typedef struct {
-    uint32_t code;
-    drv_fs_t *fs;
-    uint32_t mode;
+    uint32_t lba;   // First block of the extent.
+    uint32_t size;  // Bytes.
+    uint8_t flags;
+} iso9660_file_t;
+
+typedef struct {
+    drv_blk_t *dev;
+    iso9660_file_t root;
+    uint32_t volume_blocks;
+    char volume_id[33];
+    uint8_t ready;
+} drv_fs_iso9660_data_t;
+
+typedef struct {
+    uint32_t code;  // Handle from fs->open.
+    drv_fs_t *fs;   // 0 when the slot is free.
+    uint32_t mode;  // VFS_O_* flags.
     uint32_t offset;
-    uint32_t size;
 } vfs_file_t;
 
-void ext2_init(drv_fs_ext2_data_t *data, uint32_t first_lba);
+void ext2_init(drv_fs_ext2_data_t *data, drv_blk_t *dev, uint32_t first_lba);
+// Frees what ext2_init allocated, also when it failed halfway.
+void ext2_release(drv_fs_ext2_data_t *data);
 void ext2_print_sb(drv_fs_ext2_data_t *data);
 void ext2_print_bgdt(drv_fs_ext2_data_t *data);
 void ext2_print_inodes(drv_fs_ext2_data_t *data);
 uint32_t ext2_find_inode(drv_fs_ext2_data_t *data, uint32_t start, const char* path);
 void ext2_dump_inode(drv_fs_ext2_data_t *data, uint32_t i);
+uint32_t ext2_read(drv_fs_ext2_data_t *data, uint32_t i, uint32_t offset,
+                   uint8_t *buf, uint32_t len);
+uint32_t ext2_create(drv_fs_ext2_data_t *data, uint32_t start, const char *path,
+                     uint16_t mode);
+uint32_t ext2_write(drv_fs_ext2_data_t *data, uint32_t i, uint32_t offset,
+                    const uint8_t *buf, uint32_t len);
+uint8_t ext2_truncate(drv_fs_ext2_data_t *data, uint32_t i, uint32_t size);
+uint8_t ext2_unlink(drv_fs_ext2_data_t *data, uint32_t start, const char *path);
+uint8_t ext2_sync(drv_fs_ext2_data_t *data);
+void ext2_statfs(drv_fs_ext2_data_t *data, vfs_statfs_t *st);
+void drv_fs_ext2_init(drv_fs_t *drv);
+// drv_data is the FatFs volume prefix, e.g. "0:".
+void drv_fs_fat_init(drv_fs_t *drv);
+
+void exfat_init(drv_fs_exfat_data_t *data, uint32_t first_lba);
 
-void exfat_init(drv_fs_exfat_data_t *data, uint32_t first_lba);
\ No newline at end of file
+void iso9660_init(drv_fs_iso9660_data_t *data, drv_blk_t *dev);
+uint8_t iso9660_find(drv_fs_iso9660_data_t *data, const char *path,
+                     iso9660_file_t *file);
+uint32_t iso9660_read(drv_fs_iso9660_data_t *data, const iso9660_file_t *file,
+                      uint32_t offset, uint8_t *buf, uint32_t len);
+void iso9660_print_dir(drv_fs_iso9660_data_t *data, const char *path);
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <driver/driver_blk.h>
 #include <driver/driver_fs.h>
 #include <driver/driver_inout.h>
 #include <driver/driver_mem.h>
\ No newline at end of file
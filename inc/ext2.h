@@ -48,10 +48,19 @@ typedef struct {
     uint32_t s_last_orphan;
     uint32_t s_hash_seed[4];
     uint8_t s_def_hash_version;
-    uint8_t __reserved[3];
+    uint8_t s_jnl_backup_type;
+    uint16_t s_desc_size;
     uint32_t s_default_mount_options;
     uint32_t s_first_meta_bg;
-    uint8_t __reserved1[760];
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_count_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
+    uint8_t __reserved1[668];
 } ext2_sb_t;
 
 typedef struct {
@@ -93,3 +102,70 @@ typedef struct {
     uint8_t type;
     uint8_t str[1];
 } ext2_direntry_t;
+
+#define EXT2_FEATURE_COMPAT_DIR_INDEX   0x0020
+#define EXT2_FEATURE_INCOMPAT_FILETYPE  0x0002
+#define EXT2_FEATURE_RO_COMPAT_WRITABLE 0x0007  // Sparse, large files, btree.
+#define EXT4_FEATURE_INCOMPAT_EXTENTS   0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT     0x0080  // s_desc_size descriptors.
+#define EXT2_INDEX_FL                   0x00001000  // Directory has an HTree.
+#define EXT4_EXTENTS_FL                 0x00080000  // i_block holds extents.
+#define EXT2_FLAGS_UNSIGNED_HASH        0x0002
+
+enum {
+    EXT2_HASH_LEGACY = 0,
+    EXT2_HASH_HALF_MD4 = 1,
+    EXT2_HASH_TEA = 2,
+    EXT2_HASH_LEGACY_UNSIGNED = 3,
+    EXT2_HASH_HALF_MD4_UNSIGNED = 4,
+    EXT2_HASH_TEA_UNSIGNED = 5
+};
+
+// Block 0 of an indexed directory, after the "." and ".." entries.
+typedef struct {
+    uint32_t reserved_zero;
+    uint8_t hash_version;
+    uint8_t info_length;  // 8
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+} ext2_dx_root_info_t;
+
+// Overlays the hash of the first entry of an index block.
+typedef struct {
+    uint16_t limit;
+    uint16_t count;
+} ext2_dx_countlimit_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t block;  // Logical block in the directory.
+} ext2_dx_entry_t;
+
+#define EXT4_EXT_MAGIC        0xF30A
+#define EXT4_EXT_INIT_MAX_LEN 32768  // Longer ee_len marks unwritten extents.
+
+// Starts i_block and every tree block, followed by eh_entries entries.
+typedef struct {
+    uint16_t eh_magic;
+    uint16_t eh_entries;
+    uint16_t eh_max;
+    uint16_t eh_depth;  // 0 when the entries are extents.
+    uint32_t eh_generation;
+} ext4_extent_header_t;
+
+typedef struct {
+    uint32_t ei_block;  // First file block below this index.
+    uint32_t ei_leaf_lo;
+    uint16_t ei_leaf_hi;
+    uint16_t ei_unused;
+} ext4_extent_idx_t;
+
+typedef struct {
+    uint32_t ee_block;
+    uint16_t ee_len;
+    uint16_t ee_start_hi;
+    uint32_t ee_start_lo;
+} ext4_extent_t;
+
+uint32_t ext2_dirhash(const uint32_t seed[4], uint8_t version,
+                      const char *name, uint32_t len);
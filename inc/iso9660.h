@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#define ISO9660_BLOCK_SIZE 2048
+#define ISO9660_FLAG_DIR   0x02
+
+// Both-endian fields only keep the little endian half.
+typedef struct __attribute__((packed)) {
+    uint8_t length;
+    uint8_t ext_length;
+    uint32_t extent_lba;
+    uint32_t __extent_lba_be;
+    uint32_t size;
+    uint32_t __size_be;
+    uint8_t date[7];
+    uint8_t flags;
+    uint8_t unit_size;
+    uint8_t gap_size;
+    uint16_t volume_seq;
+    uint16_t __volume_seq_be;
+    uint8_t name_len;
+    char name[1];
+} iso9660_dirent_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;  // 1: Primary, 255: Set Terminator.
+    char id[5];    // "CD001"
+    uint8_t version;
+    uint8_t __unused0;
+    char system_id[32];
+    char volume_id[32];
+    uint8_t __unused1[8];
+    uint32_t volume_blocks;
+    uint32_t __volume_blocks_be;
+    uint8_t __unused2[32];
+    uint16_t volume_set_size;
+    uint16_t __volume_set_size_be;
+    uint16_t volume_seq;
+    uint16_t __volume_seq_be;
+    uint16_t block_size;
+    uint16_t __block_size_be;
+    uint32_t path_table_size;
+    uint32_t __path_table_size_be;
+    uint32_t path_table_l;
+    uint32_t path_table_l_opt;
+    uint32_t path_table_m;
+    uint32_t path_table_m_opt;
+    uint8_t root[34];
+} iso9660_pvd_t;
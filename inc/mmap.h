@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+#define MMAP_BASE 0xD8000000
+#define MMAP_PTS  4  // Page tables of the window, 4MB each.
+#define MMAP_MAX  16
+
+// Installs the page tables of the mapping window.
+void mmap_init(void);
+
+// Reserves read-only address space for len bytes of fd from offset, a
+// multiple of the page size. Pages are read in on first access, fd has to
+// stay open until the area is unmapped.
+void *mmap_file(int32_t fd, uint32_t offset, uint32_t len);
+uint8_t mmap_unmap(void *addr);
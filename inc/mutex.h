@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// Lock for state shared with interrupt handlers. There is no scheduler, so
+// a holder can only be preempted by an interrupt and never runs again before
+// the handler returns: waiting can't help, locking never blocks.
+typedef struct {
+    volatile uint32_t locked;
+} mutex_t;
+
+void mutex_init(mutex_t *m);
+
+// Returns 0 once the lock is held, 1 when it is taken. Only an interrupt
+// handler that preempted the holder can see it taken.
+uint8_t mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "driver/driver_fs.h"
+#include "driver/driver_mem.h"
+
+#include <stdint.h>
+
+#define PCACHE_PAGES 256
+#define PCACHE_PAGE  4096
+
+// A cached page of file data, keyed by (fs, file, index).
+typedef struct pcache_page {
+    drv_fs_t *fs;  // 0 once dropped, the page is reused when idle.
+    uint32_t file;
+    uint32_t index;  // File offset / PCACHE_PAGE.
+    uint32_t len;  // Valid bytes, the rest of the page is zero.
+    uint32_t refs;
+    uint8_t *data;  // Kernel mapping, page aligned.
+    struct pcache_page *hnext, *prev, *next;
+} pcache_page_t;
+
+typedef struct {
+    uint32_t hits, misses;
+} pcache_stats_t;
+
+extern pcache_stats_t pcache_stats;
+
+// Pages are allocated on first use at base + slot * PCACHE_PAGE from mem.
+void pcache_init(drv_mem_t *mem, uint32_t base);
+
+pcache_page_t *pcache_get(drv_fs_t *fs, uint32_t file, uint32_t index);
+void pcache_put(pcache_page_t *page);
+
+// Maps a referenced page read-only at addr, the page table of addr must
+// exist. The reference is dropped by pcache_unmap.
+uint8_t pcache_map(pcache_page_t *page, uint32_t addr, uint8_t user);
+void pcache_unmap(pcache_page_t *page, uint32_t addr);
+
+// Keep cached pages in step with writes, truncation and the last close.
+void pcache_update(drv_fs_t *fs, uint32_t file, uint32_t offset,
+                   const uint8_t *buf, uint32_t len);
+void pcache_truncate(drv_fs_t *fs, uint32_t file, uint32_t size);
+void pcache_drop(drv_fs_t *fs, uint32_t file);
+
+void pcache_print_stats(void);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "driver/driver_fs.h"
+#include "pcache.h"
+
+#include <stdint.h>
+
+#define VFS_MOUNTS 8
+#define VFS_FDS    16   // Per process, 0-2 are the console.
+#define VFS_PATH   256  // Longest normalized path.
+
+enum {
+    VFS_SEEK_SET = 0,
+    VFS_SEEK_CUR = 1,
+    VFS_SEEK_END = 2
+};
+
+typedef struct {
+    vfs_file_t files[VFS_FDS];
+} vfs_fdtable_t;
+
+// Descriptor table of the running process.
+extern vfs_fdtable_t *vfs_fds;
+// Set while read or write is inside a filesystem driver, which must not be
+// entered again from the page fault handler.
+extern uint8_t vfs_busy;
+
+uint8_t vfs_mount(const char *path, drv_fs_t *fs);
+uint8_t vfs_umount(const char *path);
+
+// These return a negative errno value on failure.
+int32_t vfs_open(const char *path, uint32_t flags);
+// Creates or truncates path for writing and grows it to size bytes up front,
+// contiguously where the filesystem supports it. Unwritten bytes are
+// undefined, shrink the file with vfs_ftruncate when done.
+int32_t vfs_create(const char *path, uint32_t flags, uint32_t size);
+int32_t vfs_read(int32_t fd, void *buf, uint32_t len);
+int32_t vfs_write(int32_t fd, const void *buf, uint32_t len);
+int32_t vfs_lseek(int32_t fd, int32_t offset, uint8_t whence);
+int32_t vfs_ftruncate(int32_t fd, uint32_t size);
+int32_t vfs_fstat(int32_t fd, uint32_t *mode, uint32_t *size);
+int32_t vfs_stat(const char *path, uint32_t *mode, uint32_t *size);
+int32_t vfs_close(int32_t fd);
+int32_t vfs_unlink(const char *path);
+int32_t vfs_statfs(const char *path, vfs_statfs_t *st);
+
+// Referenced page cache page of an open file, release with pcache_put.
+pcache_page_t *vfs_getpage(int32_t fd, uint32_t index);
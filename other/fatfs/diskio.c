@@ -7,13 +7,113 @@
 // storage control modules to the FatFs module with a defined API.
 //-----------------------------------------------------------------------
 
+#include "ff.h"  // Obtains integer types
+
 #include "diskio.h"  // Declarations of disk functions
 
 #include "arch/cmos.h"
-#include "disk.h"
-#include "ff.h"  // Obtains integer types
+#include "bcache.h"
+#include "drivers.h"
+#include "mutex.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#define DISK_FAT_CACHE 32
+
+// FAT sectors of all volumes, kept apart from the block cache so that
+// streaming file data cannot evict them. Single sector FAT I/O bypasses the
+// block cache, this is their only copy and writes stay here until sync or
+// eviction.
+typedef struct {
+    BYTE pdrv;
+    BYTE dirty;
+    LBA_t sector;
+    DWORD used;  // 0 when the slot is free.
+    BYTE data[FF_MAX_SS];
+} disk_fat_sector_t;
+
+static drv_blk_t *disk_devs[FF_VOLUMES];
+static LBA_t disk_fat_start[FF_VOLUMES], disk_fat_end[FF_VOLUMES];
+static disk_fat_sector_t disk_fat_cache[DISK_FAT_CACHE];
+static DWORD disk_fat_clock;
+// Held while the FAT cache or the FAT ranges are used, the block cache has
+// its own lock taken below this one.
+static mutex_t disk_fat_lock;
+disk_fat_stats_t disk_fat_stats;
+
+static UINT disk_fat_writeback(disk_fat_sector_t *c) {
+    if(!c->dirty) return 0;
+    if(blkdev_write(disk_devs[c->pdrv], c->sector, 1, c->data)) return 1;
+    c->dirty = 0;
+    return 0;
+}
+static UINT disk_fat_sync(BYTE pdrv) {
+    UINT err = 0;
+    for(UINT i = 0; i < DISK_FAT_CACHE; i++)
+        if(disk_fat_cache[i].used && disk_fat_cache[i].pdrv == pdrv
+           && disk_fat_writeback(&disk_fat_cache[i]))
+            err = 1;
+    return err;
+}
+static void disk_fat_drop(BYTE pdrv) {
+    disk_fat_sync(pdrv);
+    for(UINT i = 0; i < DISK_FAT_CACHE; i++)
+        if(disk_fat_cache[i].pdrv == pdrv) disk_fat_cache[i].used = 0;
+}
+
+static void disk_fat_range(BYTE pdrv, LBA_t start, LBA_t count) {
+    disk_fat_drop(pdrv);
+    // FAT sectors written through the block cache so far go out first.
+    if(count && disk_devs[pdrv]) bcache_sync(disk_devs[pdrv]);
+    disk_fat_start[pdrv] = start;
+    disk_fat_end[pdrv] = start + count;
+}
+
+void disk_attach(BYTE pdrv, drv_blk_t *dev) {
+    if(pdrv >= FF_VOLUMES || mutex_trylock(&disk_fat_lock)) return;
+    disk_fat_range(pdrv, 0, 0);  // Pending FAT writes go to the old device.
+    disk_devs[pdrv] = dev;
+    mutex_unlock(&disk_fat_lock);
+}
+
+void disk_set_fat(BYTE pdrv, LBA_t start, LBA_t count) {
+    if(pdrv >= FF_VOLUMES || mutex_trylock(&disk_fat_lock)) return;
+    disk_fat_range(pdrv, start, count);
+    mutex_unlock(&disk_fat_lock);
+}
+
+static disk_fat_sector_t *disk_fat_find(BYTE pdrv, LBA_t sector) {
+    for(UINT i = 0; i < DISK_FAT_CACHE; i++)
+        if(disk_fat_cache[i].used && disk_fat_cache[i].pdrv == pdrv
+           && disk_fat_cache[i].sector == sector) {
+            disk_fat_cache[i].used = ++disk_fat_clock;
+            return &disk_fat_cache[i];
+        }
+    return 0;
+}
+
+static UINT disk_is_fat(BYTE pdrv, LBA_t sector, UINT count) {
+    return count == 1 && disk_devs[pdrv]
+           && disk_devs[pdrv]->sector_size <= FF_MAX_SS
+           && sector >= disk_fat_start[pdrv] && sector < disk_fat_end[pdrv];
+}
+
+// Least recently used slot, filled from buff. 0 when its dirty sector can't
+// be written back.
+static disk_fat_sector_t *disk_fat_insert(BYTE pdrv, LBA_t sector,
+                                          const BYTE *buff) {
+    disk_fat_sector_t *lru = &disk_fat_cache[0];
+    for(UINT i = 1; i < DISK_FAT_CACHE; i++)
+        if(disk_fat_cache[i].used < lru->used) lru = &disk_fat_cache[i];
+    if(lru->used && disk_fat_writeback(lru)) return 0;
+    lru->pdrv = pdrv;
+    lru->dirty = 0;
+    lru->sector = sector;
+    lru->used = ++disk_fat_clock;
+    memcpy(lru->data, buff, disk_devs[pdrv]->sector_size);
+    return lru;
+}
 
 //-----------------------------------------------------------------------
 // Get Drive Status
@@ -21,7 +121,8 @@
 
 DSTATUS disk_status(BYTE pdrv) {
     // printf("ds %u\n", pdrv);
-    return 0;
+    if(pdrv >= FF_VOLUMES || disk_devs[pdrv] == 0) return STA_NOINIT;
+    return disk_devs[pdrv]->write ? 0 : STA_PROTECT;
 }
 
 //-----------------------------------------------------------------------
@@ -30,7 +131,7 @@ DSTATUS disk_status(BYTE pdrv) {
 
 DSTATUS disk_initialize(BYTE pdrv) {
     // printf("di %u\n", pdrv);
-    return 0;
+    return disk_status(pdrv);
 }
 
 //-----------------------------------------------------------------------
@@ -39,7 +140,24 @@ DSTATUS disk_initialize(BYTE pdrv) {
 
 DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
     // printf("dr %u %lX %lu\n", pdrv, sector, count);
-    uint8_t status = ide_read_sectors(0, count, sector, buff);
+    if(mutex_trylock(&disk_fat_lock)) return RES_ERROR;
+    if(disk_is_fat(pdrv, sector, count)) {
+        DRESULT res = RES_OK;
+        disk_fat_sector_t *c = disk_fat_find(pdrv, sector);
+        if(c) {
+            memcpy(buff, c->data, disk_devs[pdrv]->sector_size);
+            disk_fat_stats.hits++;
+        } else {
+            disk_fat_stats.misses++;
+            if(blkdev_read(disk_devs[pdrv], sector, 1, buff)) res = RES_ERROR;
+            else
+                disk_fat_insert(pdrv, sector, buff);
+        }
+        mutex_unlock(&disk_fat_lock);
+        return res;
+    }
+    mutex_unlock(&disk_fat_lock);
+    uint8_t status = bcache_read(disk_devs[pdrv], sector, count, buff);
     return (status == 0) ? RES_OK : RES_ERROR;
 }
 
@@ -51,7 +169,31 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
 
 DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
     // printf("dw %u %lX %lu\n", pdrv, sector, count);
-    uint8_t status = ide_write_sectors(0, count, sector, buff);
+    UINT ss = disk_devs[pdrv] ? disk_devs[pdrv]->sector_size : 0;
+    uint8_t status;
+    if(mutex_trylock(&disk_fat_lock)) return RES_ERROR;
+    if(disk_is_fat(pdrv, sector, count) && disk_devs[pdrv]->write) {
+        disk_fat_sector_t *c = disk_fat_find(pdrv, sector);
+        if(c) memcpy(c->data, buff, ss);
+        else
+            c = disk_fat_insert(pdrv, sector, buff);
+        if(c) c->dirty = 1;
+        status = c ? 0 : blkdev_write(disk_devs[pdrv], sector, 1, buff);
+        mutex_unlock(&disk_fat_lock);
+        return (status == 0) ? RES_OK : RES_ERROR;
+    }
+    status = bcache_write(disk_devs[pdrv], sector, count, buff);
+    // Longer writes over cached FAT sectors replace them once on disk, a
+    // failed one leaves them unknown.
+    for(UINT i = 0; i < count; i++) {
+        disk_fat_sector_t *c = disk_fat_find(pdrv, sector + i);
+        if(c && status) c->used = 0;
+        else if(c) {
+            memcpy(c->data, buff + i * ss, ss);
+            c->dirty = 0;
+        }
+    }
+    mutex_unlock(&disk_fat_lock);
     return (status == 0) ? RES_OK : RES_ERROR;
 }
 
@@ -63,10 +205,24 @@ DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
 
 DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
     // printf("di %u %u\n", pdrv, cmd);
+    drv_blk_t *dev = disk_devs[pdrv];
+    if(dev == 0) return RES_NOTRDY;
     switch(cmd) {
-    case CTRL_SYNC: return RES_OK; break;
-    case GET_SECTOR_COUNT: *(LBA_t *)buff = ide_devices[0].Size; break;
+    case CTRL_SYNC: {
+        if(mutex_trylock(&disk_fat_lock)) return RES_ERROR;
+        UINT err = disk_fat_sync(pdrv);
+        mutex_unlock(&disk_fat_lock);
+        if(err) return RES_ERROR;
+        return bcache_sync(dev) == 0 ? RES_OK : RES_ERROR;
+    }
+    case GET_SECTOR_COUNT: *(LBA_t *)buff = (LBA_t)dev->size; break;
     case GET_BLOCK_SIZE: *(WORD *)buff = 1; break;
+    case CTRL_TRIM: {
+        // First and last sector of a freed cluster run.
+        LBA_t *range = buff;
+        uint8_t err = bcache_trim(dev, range[0], range[1] - range[0] + 1);
+        return err == 0 ? RES_OK : RES_ERROR;
+    }
     default: return RES_PARERR;
     }
 
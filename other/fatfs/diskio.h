@@ -5,6 +5,8 @@
 #ifndef _DISKIO_DEFINED
 #define _DISKIO_DEFINED
 
+#include "ff.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -24,11 +26,22 @@ typedef enum {
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
 
+struct _driver_blk_t;
+
 DSTATUS disk_initialize(BYTE pdrv);
 DSTATUS disk_status(BYTE pdrv);
 DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count);
 DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
 DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff);
+void disk_attach(BYTE pdrv, struct _driver_blk_t* dev);
+/* Sectors start..start+count-1 of pdrv hold the FATs */
+void disk_set_fat(BYTE pdrv, LBA_t start, LBA_t count);
+
+typedef struct {
+	DWORD hits, misses;
+} disk_fat_stats_t;
+
+extern disk_fat_stats_t disk_fat_stats;
 
 /* Disk Status Bits (DSTATUS) */
 
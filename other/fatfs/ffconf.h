@@ -154,7 +154,7 @@ options have no effect. */
 / Drive/Volume Configurations
 /---------------------------------------------------------------------------*/
 
-#define FF_VOLUMES 1
+#define FF_VOLUMES 8
 /* Number of volumes (logical drives) to be used. (1-10) */
 
 #define FF_STR_VOLUME_ID 0
@@ -198,7 +198,7 @@ function needs to implement /  GET_SECTOR_SIZE command. */
 /  f_fdisk function. 0x100000000 max. This option has no effect when FF_LBA64 ==
 0. */
 
-#define FF_USE_TRIM 0
+#define FF_USE_TRIM 1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -244,7 +244,7 @@ clock. FF_NORTC_MON, /  FF_NORTC_MDAY and FF_NORTC_YEAR have no effect.
 /  bit1=1: Do not trust last allocated cluster number in the FSINFO.
 */
 
-#define FF_FS_LOCK 0
+#define FF_FS_LOCK 16
 /* The option FF_FS_LOCK switches file lock function to control duplicated file
 open /  and illegal operation to open objects. This option must be 0 when
 FF_FS_READONLY /  is 1.
@@ -256,10 +256,10 @@ files/sub-directories /      can be opened simultaneously under file lock
 control. Note that the file /      lock control is independent of re-entrancy.
 */
 
-/* #include <somertos.h>	// O/S definitions */
-#define FF_FS_REENTRANT 0
+#include "mutex.h"  // O/S definitions
+#define FF_FS_REENTRANT 1
 #define FF_FS_TIMEOUT   1000
-#define FF_SYNC_t       HANDLE
+#define FF_SYNC_t       mutex_t *
 /* The option FF_FS_REENTRANT switches the re-entrancy (thread safe) of the
 FatFs /  module itself. Note that regardless of this option, file access to
 different /  volume is always re-entrant and volume control functions,
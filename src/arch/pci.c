@@ -0,0 +1,47 @@
+#include "arch/pci.h"
+
+#include "arch/io.h"
+
+#include <stdint.h>
+
+static uint32_t pci_address(uint8_t bus, uint8_t slot, uint8_t func,
+                            uint8_t offset) {
+    return 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)(slot & 0x1F) << 11)
+           | ((uint32_t)(func & 0x07) << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    outl(0xCF8, pci_address(bus, slot, func, offset));
+    return inl(0xCFC);
+}
+
+void pci_write(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset,
+               uint32_t value) {
+    outl(0xCF8, pci_address(bus, slot, func, offset));
+    outl(0xCFC, value);
+}
+
+// Brute force scan of configuration space, returns 1 when found.
+uint8_t pci_find_class(uint8_t class, uint8_t subclass, uint8_t *bus,
+                       uint8_t *slot, uint8_t *func) {
+    for(uint16_t b = 0; b < 256; b++)
+        for(uint8_t s = 0; s < 32; s++)
+            for(uint8_t f = 0; f < 8; f++) {
+                uint32_t id = pci_read((uint8_t)b, s, f, 0);
+                if((id & 0xFFFF) == 0xFFFF) {
+                    if(f == 0) break;  // No device in this slot.
+                    continue;
+                }
+                uint32_t cls = pci_read((uint8_t)b, s, f, PCI_REG_CLASS);
+                if((cls >> 24) == class && ((cls >> 16) & 0xFF) == subclass) {
+                    *bus = (uint8_t)b;
+                    *slot = s;
+                    *func = f;
+                    return 1;
+                }
+                // Single function device, skip other functions.
+                if(f == 0 && (pci_read((uint8_t)b, s, 0, 0x0C) & 0x800000) == 0)
+                    break;
+            }
+    return 0;
+}
@@ -0,0 +1,291 @@
+#include "bcache.h"
+
+#include "mutex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BCACHE_HASH_BITS 5
+
+static bcache_buf_t bcache_bufs[BCACHE_BUFS];
+static bcache_buf_t *bcache_hash[1 << BCACHE_HASH_BITS];
+// Most recently used buffer at lru.next, least recently used at lru.prev.
+static bcache_buf_t bcache_lru = {.prev = &bcache_lru, .next = &bcache_lru};
+static uint8_t bcache_ready = 0;
+static uint8_t *bcache_ra_buf = 0;
+static uint32_t bcache_ra_bytes = 0;
+bcache_stats_t bcache_stats;
+// Held by the entry points below while they walk or change the buffers.
+static mutex_t bcache_lock;
+uint32_t bcache_ra_max = BCACHE_RA_MAX;
+
+static void bcache_lru_insert(bcache_buf_t *b) {
+    b->prev = &bcache_lru;
+    b->next = bcache_lru.next;
+    bcache_lru.next->prev = b;
+    bcache_lru.next = b;
+}
+static void bcache_lru_touch(bcache_buf_t *b) {
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    bcache_lru_insert(b);
+}
+static void bcache_init(void) {
+    for(uint32_t i = 0; i < BCACHE_BUFS; i++)
+        bcache_lru_insert(&bcache_bufs[i]);
+    bcache_ready = 1;
+}
+
+static bcache_buf_t **bcache_bucket(drv_blk_t *dev, uint64_t lba) {
+    uint32_t key = (uint32_t)lba ^ (uint32_t)(lba >> 32) ^ (uint32_t)dev;
+    return &bcache_hash[(key * 2654435761u) >> (32 - BCACHE_HASH_BITS)];
+}
+static void bcache_unhash(bcache_buf_t *b) {
+    bcache_buf_t **p = bcache_bucket(b->dev, b->lba);
+    while(*p != b) p = &(*p)->hnext;
+    *p = b->hnext;
+    b->dev = 0;
+    b->flags = 0;
+}
+
+static uint8_t bcache_writeback(bcache_buf_t *b) {
+    uint8_t err = blkdev_write(b->dev, b->lba, b->size / b->dev->sector_size,
+                               b->data);
+    if(err) return err;
+    b->flags &= (uint8_t)~BCACHE_DIRTY;
+    bcache_stats.writebacks++;
+    return 0;
+}
+
+// Returns a referenced buffer for (dev, lba, size), without reading it.
+static bcache_buf_t *bcache_get(drv_blk_t *dev, uint64_t lba, uint32_t size) {
+    if(!bcache_ready) bcache_init();
+    bcache_buf_t **bucket = bcache_bucket(dev, lba), *b;
+    for(b = *bucket; b; b = b->hnext)
+        if(b->dev == dev && b->lba == lba && b->size == size) {
+            b->refs++;
+            bcache_lru_touch(b);
+            return b;
+        }
+    // Reuse the least recently used idle buffer.
+    for(b = bcache_lru.prev; b != &bcache_lru; b = b->prev) {
+        if(b->refs) continue;
+        if(b->dev && (b->flags & BCACHE_DIRTY) && bcache_writeback(b))
+            continue;
+        break;
+    }
+    if(b == &bcache_lru) return 0;
+    if(b->dev) bcache_unhash(b);
+    if(b->data == 0 || b->size != size) {
+        free(b->data);
+        b->data = malloc(size);
+        if(b->data == 0) {
+            b->size = 0;
+            return 0;
+        }
+    }
+    b->dev = dev;
+    b->lba = lba;
+    b->size = size;
+    b->refs = 1;
+    b->hnext = *bucket;
+    *bucket = b;
+    bcache_lru_touch(b);
+    return b;
+}
+
+// Window for a miss at lba: grows while reads are sequential and halves on
+// random access, never below the demanded n sectors.
+static uint32_t bcache_ra_window(drv_blk_t *dev, uint64_t lba, uint32_t n) {
+    uint32_t window = dev->ra_window;
+    if(lba == dev->ra_next) window = window ? window * 2 : n * 2;
+    else
+        window /= 2;
+    uint32_t max = bcache_ra_max;
+    if(max > BCACHE_BUFS / 4 * n) max = BCACHE_BUFS / 4 * n;
+    if(window > max) window = max;
+    if(window > dev->size - lba) window = (uint32_t)(dev->size - lba);
+    window -= window % n;
+    dev->ra_window = window;
+    return window < n ? n : window;
+}
+
+// Reads window sectors at b->lba with one command and splits them into
+// buffers of b->size, leaving already cached ones untouched.
+static uint8_t bcache_readahead(bcache_buf_t *b, uint32_t window) {
+    drv_blk_t *dev = b->dev;
+    uint32_t bytes = window * dev->sector_size, n = b->size / dev->sector_size;
+    if(bytes > bcache_ra_bytes) {
+        free(bcache_ra_buf);
+        bcache_ra_buf = malloc(bytes);
+        bcache_ra_bytes = bcache_ra_buf ? bytes : 0;
+    }
+    if(bcache_ra_buf == 0) return blkdev_read(dev, b->lba, n, b->data);
+    // Dirty buffers in the window go out first, one evicted below would
+    // otherwise be reloaded from the older copy read here.
+    for(uint32_t i = 0; i < BCACHE_BUFS; i++) {
+        bcache_buf_t *o = &bcache_bufs[i];
+        if(o->dev == dev && (o->flags & BCACHE_DIRTY)
+           && o->lba < b->lba + window
+           && o->lba + o->size / dev->sector_size > b->lba
+           && bcache_writeback(o))
+            return 1;
+    }
+    uint8_t err = blkdev_read(dev, b->lba, window, bcache_ra_buf);
+    if(err) return err;
+    memcpy(b->data, bcache_ra_buf, b->size);
+    for(uint32_t off = n; off < window; off += n) {
+        bcache_buf_t *next = bcache_get(dev, b->lba + off, b->size);
+        if(next == 0) break;
+        if(!(next->flags & BCACHE_VALID)) {
+            memcpy(next->data, bcache_ra_buf + off * dev->sector_size,
+                   b->size);
+            next->flags |= BCACHE_VALID;
+            bcache_stats.readahead += n;
+        }
+        brelse(next);
+    }
+    return 0;
+}
+
+static bcache_buf_t *bcache_bread(drv_blk_t *dev, uint64_t lba,
+                                  uint32_t size) {
+    bcache_buf_t *b = bcache_get(dev, lba, size);
+    if(b == 0) return 0;
+    uint32_t n = size / dev->sector_size;
+    if(b->flags & BCACHE_VALID) {
+        bcache_stats.hits++;
+        dev->ra_next = lba + n;
+        return b;
+    }
+    bcache_stats.misses++;
+    uint32_t window = bcache_ra_window(dev, lba, n);
+    dev->ra_next = lba + n;
+    if(window > n ? bcache_readahead(b, window)
+                  : blkdev_read(dev, lba, n, b->data)) {
+        bcache_unhash(b);
+        b->refs = 0;
+        return 0;
+    }
+    b->flags |= BCACHE_VALID;
+    return b;
+}
+bcache_buf_t *bread(drv_blk_t *dev, uint64_t lba, uint32_t size) {
+    if(mutex_trylock(&bcache_lock)) return 0;
+    bcache_buf_t *b = bcache_bread(dev, lba, size);
+    mutex_unlock(&bcache_lock);
+    return b;
+}
+// These only touch a buffer the caller holds, they need no lock.
+void brelse(bcache_buf_t *buf) {
+    if(buf) buf->refs--;
+}
+void bdirty(bcache_buf_t *buf) { buf->flags |= BCACHE_DIRTY; }
+
+// Keeps cached buffers and a direct transfer of sectors lba..lba+count
+// coherent: a read picks up unwritten data, a write updates cached copies.
+static void bcache_overlap(drv_blk_t *dev, uint64_t lba, uint32_t count,
+                           uint8_t *buf, uint8_t write) {
+    uint32_t ss = dev->sector_size;
+    uint64_t end = lba + count;
+    for(uint32_t i = 0; i < BCACHE_BUFS; i++) {
+        bcache_buf_t *b = &bcache_bufs[i];
+        if(b->dev != dev || !(b->flags & BCACHE_VALID)) continue;
+        uint64_t bend = b->lba + b->size / ss;
+        if(b->lba >= end || bend <= lba) continue;
+        uint64_t s = b->lba > lba ? b->lba : lba, e = bend < end ? bend : end;
+        uint8_t *cached = b->data + (uint32_t)(s - b->lba) * ss,
+                *user = buf + (uint32_t)(s - lba) * ss;
+        if(write) {
+            memcpy(cached, user, (uint32_t)(e - s) * ss);
+            if(b->lba >= lba && bend <= end)
+                b->flags &= (uint8_t)~BCACHE_DIRTY;
+        } else if(b->flags & BCACHE_DIRTY)
+            memcpy(user, cached, (uint32_t)(e - s) * ss);
+    }
+}
+
+// Single sectors are cached, longer transfers go straight to the device.
+uint8_t bcache_read(drv_blk_t *dev, uint64_t lba, uint32_t count,
+                    uint8_t *buf) {
+    if(dev == 0 || mutex_trylock(&bcache_lock)) return 1;
+    uint8_t err = 0;
+    if(count == 1) {
+        bcache_buf_t *b = bcache_bread(dev, lba, dev->sector_size);
+        if(b) {
+            memcpy(buf, b->data, dev->sector_size);
+            brelse(b);
+        } else
+            err = 1;
+    } else if((err = blkdev_read(dev, lba, count, buf)) == 0)
+        bcache_overlap(dev, lba, count, buf, 0);
+    mutex_unlock(&bcache_lock);
+    return err;
+}
+uint8_t bcache_write(drv_blk_t *dev, uint64_t lba, uint32_t count,
+                     const uint8_t *buf) {
+    if(dev == 0) return 1;
+    if(dev->write == 0) return 8;
+    if(count == 1 && lba >= dev->size) return 2;
+    if(mutex_trylock(&bcache_lock)) return 1;
+    uint8_t err = 0;
+    if(count == 1) {
+        bcache_buf_t *b = bcache_get(dev, lba, dev->sector_size);
+        if(b) {
+            memcpy(b->data, buf, dev->sector_size);
+            b->flags |= BCACHE_VALID | BCACHE_DIRTY;
+            brelse(b);
+        } else
+            err = blkdev_write(dev, lba, 1, buf);
+    } else if((err = blkdev_write(dev, lba, count, buf)) == 0)
+        bcache_overlap(dev, lba, count, (uint8_t *)buf, 1);
+    mutex_unlock(&bcache_lock);
+    return err;
+}
+
+// Buffers inside the range are dropped first, or just made clean while
+// referenced, a later write back would undo the discard.
+uint8_t bcache_trim(drv_blk_t *dev, uint64_t lba, uint32_t count) {
+    if(dev == 0 || mutex_trylock(&bcache_lock)) return 1;
+    for(uint32_t i = 0; bcache_ready && i < BCACHE_BUFS; i++) {
+        bcache_buf_t *b = &bcache_bufs[i];
+        if(b->dev != dev || b->lba < lba
+           || b->lba + b->size / dev->sector_size > lba + count)
+            continue;
+        if(b->refs == 0)
+            bcache_unhash(b);
+        else
+            b->flags &= (uint8_t)~BCACHE_DIRTY;
+    }
+    mutex_unlock(&bcache_lock);
+    return blkdev_trim(dev, lba, count);
+}
+
+// Writes back dirty buffers of dev in ascending lba order, then flushes it.
+uint8_t bcache_sync(drv_blk_t *dev) {
+    if(mutex_trylock(&bcache_lock)) return 1;
+    for(;;) {
+        bcache_buf_t *low = 0;
+        for(uint32_t i = 0; i < BCACHE_BUFS; i++) {
+            bcache_buf_t *b = &bcache_bufs[i];
+            if(b->dev == dev && (b->flags & BCACHE_DIRTY)
+               && (low == 0 || b->lba < low->lba))
+                low = b;
+        }
+        if(low == 0) break;
+        uint8_t err = bcache_writeback(low);
+        if(err) {
+            mutex_unlock(&bcache_lock);
+            return err;
+        }
+    }
+    mutex_unlock(&bcache_lock);
+    return blkdev_flush(dev);
+}
+
+void bcache_print_stats(void) {
+    printf("bcache hits %lu misses %lu writebacks %lu readahead %lu\n",
+           bcache_stats.hits, bcache_stats.misses, bcache_stats.writebacks,
+           bcache_stats.readahead);
+}
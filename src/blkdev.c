@@ -0,0 +1,52 @@
+#include "drivers.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static drv_blk_t *blkdevs[BLKDEV_MAX];
+
+uint8_t blkdev_register(drv_blk_t *drv) {
+    for(uint8_t i = 0; i < BLKDEV_MAX; i++)
+        if(blkdevs[i] == 0) {
+            blkdevs[i] = drv;
+            return 0;
+        }
+    return 1;
+}
+
+drv_blk_t *blkdev_find(const char *name) {
+    for(uint8_t i = 0; i < BLKDEV_MAX; i++)
+        if(blkdevs[i] && strcmp(blkdevs[i]->name, name) == 0)
+            return blkdevs[i];
+    return 0;
+}
+
+drv_blk_t *blkdev_get(uint8_t n) { return n < BLKDEV_MAX ? blkdevs[n] : 0; }
+
+static uint8_t blkdev_range(drv_blk_t *drv, uint64_t lba, uint32_t count) {
+    return drv == 0 || lba + count > drv->size;
+}
+
+uint8_t blkdev_read(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                    uint8_t *buf) {
+    if(blkdev_range(drv, lba, count)) return 2;
+    return drv->read(drv, lba, count, buf);
+}
+
+uint8_t blkdev_write(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                     const uint8_t *buf) {
+    if(blkdev_range(drv, lba, count)) return 2;
+    if(drv->write == 0) return 8;  // Write-Protected.
+    return drv->write(drv, lba, count, buf);
+}
+
+uint8_t blkdev_flush(drv_blk_t *drv) {
+    if(drv == 0) return 1;
+    return drv->flush ? drv->flush(drv) : 0;
+}
+
+// Discarding is a hint, devices without support just ignore it.
+uint8_t blkdev_trim(drv_blk_t *drv, uint64_t lba, uint32_t count) {
+    if(blkdev_range(drv, lba, count)) return 2;
+    return drv->trim ? drv->trim(drv, lba, count) : 0;
+}
@@ -1,6 +1,8 @@
 #include "disk.h"
 
+#include "arch/intr.h"
 #include "arch/io.h"
+#include "drivers.h"
 #include "kernel.h"
 
 #include <stdint.h>
@@ -24,19 +26,34 @@
 #define ATA_ER_TK0NF 0x02  // Track 0 not found
 #define ATA_ER_AMNF  0x01  // No address mark
 
+#define ATA_CMD_DSM             0x06
 #define ATA_CMD_READ_PIO        0x20
 #define ATA_CMD_READ_PIO_EXT    0x24
 #define ATA_CMD_READ_DMA        0xC8
 #define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_READ_MULTI      0xC4
+#define ATA_CMD_READ_MULTI_EXT  0x29
 #define ATA_CMD_WRITE_PIO       0x30
 #define ATA_CMD_WRITE_PIO_EXT   0x34
 #define ATA_CMD_WRITE_DMA       0xCA
 #define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_WRITE_MULTI     0xC5
+#define ATA_CMD_WRITE_MULTI_EXT 0x39
+#define ATA_CMD_SET_MULTIPLE    0xC6
 #define ATA_CMD_CACHE_FLUSH     0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT 0xEA
 #define ATA_CMD_PACKET          0xA0
 #define ATA_CMD_IDENTIFY_PACKET 0xA1
 #define ATA_CMD_IDENTIFY        0xEC
+#define ATA_CMD_SET_FEATURES    0xEF
+
+#define ATA_FEATURE_WCACHE_ON  0x02
+#define ATA_FEATURE_WCACHE_OFF 0x82
+#define ATA_DSM_TRIM           0x01
+
+#define ATAPI_CMD_READ_CAPACITY 0x25
+#define ATAPI_CMD_READ10        0x28
+#define ATAPI_CMD_READ12        0xA8
 
 #define ATA_IDENT_DEVICETYPE   0
 #define ATA_IDENT_CYLINDERS    2
@@ -44,11 +61,14 @@
 #define ATA_IDENT_SECTORS      12
 #define ATA_IDENT_SERIAL       20
 #define ATA_IDENT_MODEL        54
+#define ATA_IDENT_MAX_MULTIPLE 94
+#define ATA_IDENT_DWORD_IO     96
 #define ATA_IDENT_CAPABILITIES 98
 #define ATA_IDENT_FIELDVALID   106
 #define ATA_IDENT_MAX_LBA      120
 #define ATA_IDENT_COMMANDSETS  164
 #define ATA_IDENT_MAX_LBA_EXT  200
+#define ATA_IDENT_DSM          338
 
 #define IDE_ATA   0x00
 #define IDE_ATAPI 0x01
@@ -73,34 +93,93 @@
 #define ATA_REG_CONTROL    0x0C
 #define ATA_REG_ALTSTATUS  0x0C
 #define ATA_REG_DEVADDRESS 0x0D
+#define ATA_REG_BMCOMMAND  0x0E
+#define ATA_REG_BMSTATUS   0x10
+#define ATA_REG_BMPRDT     0x12
+
+#define ATA_BM_CMD_START 0x01  // Start/Stop Bus Master
+#define ATA_BM_CMD_READ  0x08  // Bus Master writes to memory
+#define ATA_BM_SR_ACTIVE 0x01  // Bus Master IDE active
+#define ATA_BM_SR_ERR    0x02  // PRD or PCI error
+#define ATA_BM_SR_INTR   0x04  // Interrupt raised by drive
 
 // Channels:
 #define ATA_PRIMARY   0x00
 #define ATA_SECONDARY 0x01
 
-// Directions:
-#define ATA_READ  0x00
-#define ATA_WRITE 0x01
+// Channel states:
+#define IDE_IDLE      0x00
+#define IDE_PIO_READ  0x01
+#define IDE_PIO_WRITE 0x02
+#define IDE_DMA       0x03
+#define IDE_NODATA    0x04
+#define IDE_PACKET    0x05  // ATAPI PIO read, ends on an IRQ without DRQ.
 
 static struct IDEChannelRegisters {
-    uint16_t base;   // I/O Base.
-    uint16_t ctrl;   // Control Base
-    uint16_t bmide;  // Bus Master IDE
-    uint8_t nIEN;    // nIEN (No Interrupt);
+    uint16_t base;           // I/O Base.
+    uint16_t ctrl;           // Control Base
+    uint16_t bmide;          // Bus Master IDE
+    uint8_t nIEN;            // nIEN (No Interrupt);
+    volatile uint8_t state;  // Command in flight, IDE_IDLE when none.
+    uint8_t drive;           // Drive which issued the command.
+    uint32_t left;           // 512-byte units left in current PIO segment.
+    uint32_t total;          // 512-byte units left in PIO command.
+    uint8_t multiple;        // 512-byte units per DRQ block.
+    uint8_t io32;            // Use 32-bit data port transfers.
+    uint8_t *buf;            // Next sector in PIO transfer.
+    ide_request_t *active;   // Merged requests of the command in flight.
+    ide_request_t *seg;      // Request owning the current PIO segment.
+    ide_request_t *queue;    // Pending requests sorted by drive and LBA.
+    uint8_t pos_drive;       // Elevator position, end of last command.
+    uint64_t pos_lba;
 } channels[2];
 
+// Sectors in one command, larger transfers are split.
+#define IDE_MAX_SECTORS_LBA48 65536
+#define IDE_MAX_SECTORS_LBA28 256
+#define IDE_MAX_SECTORS_ATAPI 16384  // 32MiB, what one PRD table covers.
+
+// DSM TRIM ranges, 8 bytes each, in one 512-byte block per command.
+#define IDE_TRIM_RANGES    64
+#define IDE_TRIM_RANGE_MAX 0xFFFF
+
 struct ide_device ide_devices[4];
 
+// Written sectors may still sit in the drive cache until the next flush.
+static uint8_t ide_dirty[4];
+
+// Block devices hda..hdd registered for present drives.
+static const char *ide_blk_names[4] = {"hda", "hdb", "hdc", "hdd"};
+static drv_ide_data_t ide_blk_data[4];
+drv_blk_t ide_blk[4];
+
 static uint8_t ide_buf[2048] = {0};
 
+// Physical Region Descriptor, table must not cross a 64KiB boundary.
+typedef struct {
+    uint32_t addr;
+    uint16_t size;   // 0 means 64KiB
+    uint16_t flags;  // Bit 15 marks the last entry
+} ide_prd_t;
+
+#define IDE_PRD_EOT 0x8000
+#define IDE_PRD_MAX 8192  // Page per entry for a 32MiB LBA48 transfer.
+
+static ide_prd_t __attribute__((aligned(65536))) ide_prdt[2][IDE_PRD_MAX];
+
 static uint8_t ide_read(uint8_t channel, uint8_t reg);
 static void ide_write(uint8_t channel, uint8_t reg, uint8_t data);
 static void ide_read_buffer(uint8_t channel, uint8_t reg, uint32_t buffer,
                             uint32_t quads);
 static uint8_t ide_polling(uint8_t channel, uint8_t advanced_check);
+static uint8_t ide_build_prdt(uint8_t channel, const ide_request_t *req);
 static uint8_t ide_print_error(uint32_t drive, uint8_t err);
-static uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba,
-                              uint8_t numsects, uint8_t *buf);
+static uint8_t ide_ata_start(uint8_t channel, ide_request_t *req);
+static uint8_t ide_atapi_start(uint8_t channel, ide_request_t *req);
+static void ide_ata_nodata(uint8_t channel, ide_request_t *req);
+static uint8_t ide_ata_trim(uint8_t channel, ide_request_t *req);
+static void ide_pio_block(struct IDEChannelRegisters *ch, uint8_t direction);
+static void ide_dispatch(uint8_t channel);
 
 static uint8_t ide_read(uint8_t channel, uint8_t reg) {
     // printf("ir %02x %02x    ", (uint32_t)channel, (uint32_t) reg);
@@ -201,6 +280,43 @@ poll_loop:
     return 0;  // No Error.
 }
 
+static uint8_t ide_build_prdt(uint8_t channel, const ide_request_t *req) {
+    ide_prd_t *prd = ide_prdt[channel];
+    uint32_t n = 0;
+    for(; req; req = req->merged) {
+        uint32_t virt = (uint32_t)req->buf,
+                 bytes = req->count * ide_devices[req->drive].SectorSize;
+        if(virt & 1) return 1;  // Bus Master needs word aligned buffers.
+        while(bytes) {
+            uint32_t phys = get_physaddr(virt);
+            if(phys == 0xFFFFFFFF) return 1;
+            uint32_t len = 4096 - (virt & 0xFFF);  // Rest of this page.
+            if(len > bytes) len = bytes;
+            if(n > 0) {
+                // Join physically contiguous pages inside one 64KiB region.
+                uint32_t last = prd[n - 1].size ? prd[n - 1].size : 0x10000;
+                if(prd[n - 1].addr + last == phys
+                   && (prd[n - 1].addr >> 16) == ((phys + len - 1) >> 16)) {
+                    prd[n - 1].size = (uint16_t)(last + len);
+                    virt += len;
+                    bytes -= len;
+                    continue;
+                }
+            }
+            if(n == IDE_PRD_MAX) return 1;
+            prd[n].addr = phys;
+            prd[n].size = (uint16_t)len;
+            prd[n].flags = 0;
+            n++;
+            virt += len;
+            bytes -= len;
+        }
+    }
+    if(n == 0) return 1;
+    prd[n - 1].flags = IDE_PRD_EOT;
+    return 0;
+}
+
 static uint8_t ide_print_error(uint32_t drive, uint8_t err) {
     if(err == 0) return err;
 
@@ -263,6 +379,38 @@ static uint8_t ide_print_error(uint32_t drive, uint8_t err) {
     return err;
 }
 
+// READ CAPACITY by polling, IRQs are still disabled during detection.
+static void ide_atapi_capacity(uint8_t channel, uint8_t drive) {
+    uint8_t packet[12] = {ATAPI_CMD_READ_CAPACITY};
+    uint32_t cap[2], count = 6;
+    uint8_t *p = packet;
+    ide_devices[drive].Size = 0;  // No medium.
+    ide_write(channel, ATA_REG_HDDEVSEL,
+              (uint8_t)(0xA0 | (ide_devices[drive].Drive << 4)));
+    ide_polling(channel, 0);
+    ide_write(channel, ATA_REG_FEATURES, 0);  // PIO.
+    ide_write(channel, ATA_REG_LBA1, sizeof(cap));
+    ide_write(channel, ATA_REG_LBA2, 0);
+    ide_write(channel, ATA_REG_COMMAND, ATA_CMD_PACKET);
+    if(ide_polling(channel, 1)) return;
+    asm volatile("rep outsw"
+                 : "+S"(p), "+c"(count)
+                 : "d"(channels[channel].base)
+                 : "memory");
+    if(ide_polling(channel, 1)) return;
+    p = (uint8_t *)cap;
+    count = 4;
+    asm volatile("rep insw"
+                 : "+D"(p), "+c"(count)
+                 : "d"(channels[channel].base)
+                 : "memory");
+    ide_polling(channel, 0);
+    // Big endian last LBA and block length.
+    ide_devices[drive].Size = (uint64_t)__builtin_bswap32(cap[0]) + 1;
+    ide_devices[drive].SectorSize = (uint16_t)__builtin_bswap32(cap[1]);
+    if(ide_devices[drive].SectorSize == 0) ide_devices[drive].SectorSize = 2048;
+}
+
 void ide_initialize(uint16_t BAR0, uint16_t BAR1, uint16_t BAR2, uint16_t BAR3,
                     uint16_t BAR4) {
     uint8_t k, count = 0;
@@ -276,10 +424,15 @@ void ide_initialize(uint16_t BAR0, uint16_t BAR1, uint16_t BAR2, uint16_t BAR3,
       = (uint16_t)(BAR2 & 0xFFFFFFFC);  // default 0x170
     channels[ATA_SECONDARY].ctrl
       = (uint16_t)(BAR3 & 0xFFFFFFFC);  // default 0x376
-    channels[ATA_PRIMARY].bmide
-      = (uint16_t)(BAR4 & 0xFFFFFFFC) + 0;  // Bus Master IDE
-    channels[ATA_SECONDARY].bmide
-      = (uint16_t)(BAR4 & 0xFFFFFFFC) + 8;  // Bus Master IDE
+    if(BAR4 & 0xFFFFFFFC) {
+        channels[ATA_PRIMARY].bmide
+          = (uint16_t)(BAR4 & 0xFFFFFFFC) + 0;  // Bus Master IDE
+        channels[ATA_SECONDARY].bmide
+          = (uint16_t)(BAR4 & 0xFFFFFFFC) + 8;  // Bus Master IDE
+    } else {
+        channels[ATA_PRIMARY].bmide = 0;  // No Bus Master, PIO only.
+        channels[ATA_SECONDARY].bmide = 0;
+    }
 
     // 2- Disable IRQs:
     ide_write(ATA_PRIMARY, ATA_REG_CONTROL, 2);
@@ -360,18 +513,43 @@ void ide_initialize(uint16_t BAR0, uint16_t BAR1, uint16_t BAR2, uint16_t BAR3,
               = *((uint16_t *)(ide_buf + ATA_IDENT_CAPABILITIES));
             ide_devices[count].CommandSets
               = *((uint32_t *)(ide_buf + ATA_IDENT_COMMANDSETS));
+            ide_devices[count].Dma
+              = channels[i].bmide != 0
+                && (ide_devices[count].Capabilities & 0x100) != 0;
+
+            // (VII) Enable block mode, sectors per DRQ from IDENTIFY word 47:
+            ide_devices[count].Multiple = 1;
+            ide_devices[count].Io32
+              = type == IDE_ATA && (ide_buf[ATA_IDENT_DWORD_IO] & 1);
+            if(type == IDE_ATA && ide_buf[ATA_IDENT_MAX_MULTIPLE] > 1) {
+                ide_write(i, ATA_REG_SECCOUNT0,
+                          ide_buf[ATA_IDENT_MAX_MULTIPLE]);
+                ide_write(i, ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+                if(ide_polling(i, 0) == 0
+                   && !(ide_read(i, ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF)))
+                    ide_devices[count].Multiple
+                      = ide_buf[ATA_IDENT_MAX_MULTIPLE];
+            }
+
+            // DSM is a DMA command with 48-bit registers.
+            ide_devices[count].Trim
+              = type == IDE_ATA && ide_devices[count].Dma
+                && (ide_devices[count].CommandSets & (1 << 26))
+                && (ide_buf[ATA_IDENT_DSM] & 1);
 
-            // (VII) Get Size:
-            if(ide_devices[count].CommandSets & (1 << 26))
+            // (VIII) Get Size:
+            ide_devices[count].SectorSize = type == IDE_ATA ? 512 : 2048;
+            if(type == IDE_ATAPI) ide_atapi_capacity(i, count);
+            else if(ide_devices[count].CommandSets & (1 << 26))
                 // Device uses 48-Bit Addressing:
                 ide_devices[count].Size
-                  = *((unsigned int *)(ide_buf + ATA_IDENT_MAX_LBA_EXT));
+                  = *((uint64_t *)(ide_buf + ATA_IDENT_MAX_LBA_EXT));
             else
                 // Device uses CHS or 28-bit Addressing:
                 ide_devices[count].Size
                   = *((unsigned int *)(ide_buf + ATA_IDENT_MAX_LBA));
 
-            // (VIII) String indicates model of device (like Western Digital HDD
+            // (IX) String indicates model of device (like Western Digital HDD
             // and SONY DVD-RW...):
             for(k = 0; k < 40; k += 2) {
                 ide_devices[count].Model[k] = ide_buf[ATA_IDENT_MODEL + k + 1];
@@ -382,66 +560,85 @@ void ide_initialize(uint16_t BAR0, uint16_t BAR1, uint16_t BAR2, uint16_t BAR3,
             count++;
         }
 
-    // 4- Print Summary:
+    // 4- Enable IRQs, completion is signalled by IRQ14 and IRQ15:
+    set_intr_gate(0x2E, irq14);
+    set_intr_gate(0x2F, irq15);
+    ide_write(ATA_PRIMARY, ATA_REG_CONTROL, channels[ATA_PRIMARY].nIEN = 0);
+    ide_write(ATA_SECONDARY, ATA_REG_CONTROL,
+              channels[ATA_SECONDARY].nIEN = 0);
+    (void)ide_read(ATA_PRIMARY, ATA_REG_STATUS);  // Drop pending IRQs.
+    (void)ide_read(ATA_SECONDARY, ATA_REG_STATUS);
+    enable_irq(14);
+    enable_irq(15);
+
+    // 5- Register Block Devices:
+    for(uint8_t i = 0; i < 4; i++)
+        if(ide_devices[i].Reserved == 1) {
+            ide_blk_data[i].drive = i;
+            ide_blk[i].drv_data = &ide_blk_data[i];
+            ide_blk[i].name = ide_blk_names[i];
+            drv_ide_blk_init(&ide_blk[i]);
+            blkdev_register(&ide_blk[i]);
+        }
+
+    // 6- Print Summary:
     for(uint8_t i = 0; i < 4; i++)
         if(ide_devices[i].Reserved == 1) {
             printf(
-              " Found %s Drive %ldMB - %s %04X\n",
+              " Found %s Drive %ldMB - %s %04X%s%s\n",
               (const char *[]){"ATA", "ATAPI"}[ide_devices[i].Type], /* Type */
-              ide_devices[i].Size / 1024 / 2,                        /* Size */
-              ide_devices[i].Model, ide_devices[i].Capabilities);
+              (uint32_t)(ide_devices[i].Size * ide_devices[i].SectorSize
+                         / 1024 / 1024), /* Size */
+              ide_devices[i].Model, ide_devices[i].Capabilities,
+              ide_devices[i].Dma ? " DMA" : "",
+              ide_devices[i].Trim ? " TRIM" : "");
         }
 }
 
-static uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba,
-                              uint8_t numsects, uint8_t *buf) {
+static uint8_t ide_ata_start(uint8_t channel, ide_request_t *req) {
     uint8_t lba_mode /* 0: CHS, 1:LBA28, 2: LBA48 */,
       dma /* 0: No DMA, 1: DMA */, cmd;
     uint8_t lba_io[6];
-    uint8_t channel = ide_devices[drive].Channel;  // Read the Channel.
+    uint8_t direction = req->direction, drive = req->drive;
+    uint64_t lba = req->lba;
+    uint32_t numsects = 0;
+    struct IDEChannelRegisters *ch = &channels[channel];
+    for(ide_request_t *r = req; r; r = r->merged) numsects += r->count;
     uint32_t slavebit
       = ide_devices[drive].Drive;  // Read the Drive [Master/Slave]
-    uint32_t bus = channels[channel]
-                     .base;  // Bus Base, like 0x1F0 which is also data port.
-    // uint32_t words = 256; // Almost every ATA drive has a sector-size of
-    // 512-byte.
     uint16_t cyl;
     uint8_t head, sect, err;
 
-    ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = 1 + 0x02);
-    // printf("capabilities %04X\n", ide_devices[drive].Capabilities);
+    ide_write(channel, ATA_REG_CONTROL, ch->nIEN = 0);  // Enable IRQs.
 
     // (I) Select one from LBA28, LBA48 or CHS;
-    if(lba >= 0x10000000) {  // Sure Drive should support LBA in this case, or
-                             // you are giving a wrong LBA.
+    if(ide_devices[drive].CommandSets & (1 << 26)) {  // Drive supports LBA48?
         // LBA48:
         lba_mode = 2;
-        lba_io[0] = (uint8_t)((lba & 0x000000FF) >> 0);
-        lba_io[1] = (uint8_t)((lba & 0x0000FF00) >> 8);
-        lba_io[2] = (uint8_t)((lba & 0x00FF0000) >> 16);
-        lba_io[3] = (uint8_t)((lba & 0xFF000000) >> 24);
-        lba_io[4]
-          = 0;  // LBA28 is integer, so 32-bits are enough to access 2TB.
-        lba_io[5]
-          = 0;     // LBA28 is integer, so 32-bits are enough to access 2TB.
+        lba_io[0] = (uint8_t)(lba >> 0);
+        lba_io[1] = (uint8_t)(lba >> 8);
+        lba_io[2] = (uint8_t)(lba >> 16);
+        lba_io[3] = (uint8_t)(lba >> 24);
+        lba_io[4] = (uint8_t)(lba >> 32);
+        lba_io[5] = (uint8_t)(lba >> 40);
         head = 0;  // Lower 4-bits of HDDEVSEL are not used here.
-        printf("ide lba48\n");
     } else if(ide_devices[drive].Capabilities & 0x200) {  // Drive supports LBA?
         // LBA28:
         lba_mode = 1;
-        lba_io[0] = (lba & 0x00000FF) >> 0;
-        lba_io[1] = (lba & 0x000FF00) >> 8;
-        lba_io[2] = (lba & 0x0FF0000) >> 16;
+        lba_io[0] = (uint8_t)((lba & 0x00000FF) >> 0);
+        lba_io[1] = (uint8_t)((lba & 0x000FF00) >> 8);
+        lba_io[2] = (uint8_t)((lba & 0x0FF0000) >> 16);
         lba_io[3] = 0;  // These Registers are not used here.
         lba_io[4] = 0;  // These Registers are not used here.
         lba_io[5] = 0;  // These Registers are not used here.
-        head = (lba & 0xF000000) >> 24;
+        head = (uint8_t)((lba & 0xF000000) >> 24);
         // printf("ide lba28\n");
     } else {
         // CHS:
         lba_mode = 0;
-        sect = (lba & 0x3F) + 1;
-        cyl = (uint16_t)((lba + 1 - sect) / (16 * 63));
+        uint32_t chs_lba = (uint32_t)lba;  // Small drives only.
+        sect = (uint8_t)((chs_lba & 0x3F) + 1);
+        cyl = (uint16_t)((chs_lba + 1 - sect) / (16 * 63));
         lba_io[0] = sect;
         lba_io[1] = (uint8_t)(cyl & 0xFF);
         lba_io[2] = (uint8_t)((cyl >> 8) & 0xFF);
@@ -449,24 +646,35 @@ static uint8_t ide_ata_access(uint8_t direction, uint8_t drive, uint32_t lba,
         lba_io[4] = 0;
         lba_io[5] = 0;
         head = (uint8_t)(
-          (lba + 1 - sect) % (16 * 63)
+          (chs_lba + 1 - sect) % (16 * 63)
           / (63));  // Head number is written to HDDEVSEL lower 4-bits.
         printf("ide chs\n");
     }
 
     // (II) See if drive supports DMA or not;
-    dma = 0;  // We don't support DMA
+    // Falls back to PIO when the buffer can't be described by a PRD table.
+    dma = ide_devices[drive].Dma
+          && ide_build_prdt(channel, req) == 0;
 
     // (III) Wait if the drive is busy;
     // while ((ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY) == ATA_SR_BSY) ;
     // // Wait if busy.
 access_loop:
-    asm goto("in al,dx\ntest al,cl\njnz %l2" ::"d"(channels[channel].base
-                                                   + ATA_REG_STATUS),
+    asm goto("in al,dx\ntest al,cl\njnz %l2" ::"d"(ch->base + ATA_REG_STATUS),
              "c"(ATA_SR_BSY)
              : "al"
              : access_loop);
 
+    if(dma) {
+        outl(ch->bmide + ATA_REG_BMPRDT - 0x0E,
+             get_physaddr((uint32_t)ide_prdt[channel]));
+        ide_write(channel, ATA_REG_BMCOMMAND,
+                  direction == ATA_READ ? ATA_BM_CMD_READ : 0);
+        ide_write(channel, ATA_REG_BMSTATUS,
+                  ide_read(channel, ATA_REG_BMSTATUS) | ATA_BM_SR_ERR
+                    | ATA_BM_SR_INTR);  // Clear Error and Interrupt bits.
+    }
+
     // (IV) Select Drive from the controller;
     if(lba_mode == 0)
         ide_write(channel, ATA_REG_HDDEVSEL,
@@ -477,12 +685,13 @@ access_loop:
 
     // (V) Write Parameters;
     if(lba_mode == 2) {
-        ide_write(channel, ATA_REG_SECCOUNT1, 0);
+        ide_write(channel, ATA_REG_SECCOUNT1, (uint8_t)(numsects >> 8));
         ide_write(channel, ATA_REG_LBA3, lba_io[3]);
         ide_write(channel, ATA_REG_LBA4, lba_io[4]);
         ide_write(channel, ATA_REG_LBA5, lba_io[5]);
     }
-    ide_write(channel, ATA_REG_SECCOUNT0, numsects);
+    ide_write(channel, ATA_REG_SECCOUNT0,
+              (uint8_t)numsects);  // 0 means 256 or 65536 in LBA48.
     ide_write(channel, ATA_REG_LBA0, lba_io[0]);
     ide_write(channel, ATA_REG_LBA1, lba_io[1]);
     ide_write(channel, ATA_REG_LBA2, lba_io[2]);
@@ -507,78 +716,572 @@ access_loop:
     if(lba_mode == 0 && dma == 1 && direction == 1) cmd = ATA_CMD_WRITE_DMA;
     if(lba_mode == 1 && dma == 1 && direction == 1) cmd = ATA_CMD_WRITE_DMA;
     if(lba_mode == 2 && dma == 1 && direction == 1) cmd = ATA_CMD_WRITE_DMA_EXT;
+    if(!dma && ide_devices[drive].Multiple > 1)  // PIO in blocks of sectors.
+        cmd = (uint8_t[]){ATA_CMD_READ_MULTI, ATA_CMD_READ_MULTI,
+                          ATA_CMD_READ_MULTI_EXT, ATA_CMD_WRITE_MULTI,
+                          ATA_CMD_WRITE_MULTI,
+                          ATA_CMD_WRITE_MULTI_EXT}[direction * 3 + lba_mode];
+
+    // (VII) Prepare the channel, the IRQ may arrive right after the command.
+    ch->drive = drive;
+    ch->active = ch->seg = req;
+    ch->buf = req->buf;
+    ch->left = req->count;
+    ch->total = numsects;
+    ch->multiple = ide_devices[drive].Multiple;
+    ch->io32 = ide_devices[drive].Io32;
+    ch->state
+      = dma ? IDE_DMA : (direction == ATA_READ ? IDE_PIO_READ : IDE_PIO_WRITE);
     ide_write(channel, ATA_REG_COMMAND, cmd);  // Send the Command.
 
-    if(dma) return 4;
-    // if (direction == 0);
-    //     // DMA Read.
-    // else;
-    //     // DMA Write.
-    else if(direction == 0)
-        // PIO Read.
-        for(uint8_t i = 0; i < numsects; i++) {
-            if((err = ide_polling(channel, 1)) != 0) {
-                printf("poll err %u\n", err);
-                return err;  // Polling, set error and exit if there is.
-            }
-            // asm("pushw %es");
-            // asm("mov %%ax, %%es" : : "a"(selector));
-            // printf("reading sector %u\n", i);
-            asm("rep insw" ::"c"(256), "d"(bus), "D"(buf),
-                "a"(i));  // Receive Data
-                          // asm("popw %es");
-                          // buf += (256*2);
-        }
-    else {
-        // PIO Write.
-        for(uint8_t i = 0; i < numsects; i++) {
-            ide_polling(channel, 0);  // Polling.
-            // asm("pushw %ds");
-            // asm("mov %%ax, %%ds"::"a"(selector));
-            asm("rep outsw" ::"c"(256), "d"(bus),
-                "S"((uint32_t)buf));  // Send Data
-                                      // asm("popw %ds");
-                                      // buf += (256*2);
+    if(dma)
+        // DMA Read or DMA Write, direction is already in the command register.
+        ide_write(channel, ATA_REG_BMCOMMAND,
+                  (direction == ATA_READ ? ATA_BM_CMD_READ : 0)
+                    | ATA_BM_CMD_START);
+    else if(direction == ATA_WRITE) {
+        // PIO Write, first sector is sent without waiting for an IRQ.
+        if((err = ide_polling(channel, 1)) != 0) {
+            ch->state = IDE_IDLE;
+            return err;
         }
+        ide_pio_block(ch, ATA_WRITE);
+    }
+    // PIO Read continues in ide_irq when the first sector is ready.
+
+    return 0;
+}
+
+static void ide_ata_nodata(uint8_t channel, ide_request_t *req) {
+    struct IDEChannelRegisters *ch = &channels[channel];
+    uint8_t lba48 = (ide_devices[req->drive].CommandSets & (1 << 26)) != 0;
+nodata_loop:
+    asm goto("in al,dx\ntest al,cl\njnz %l2" ::"d"(ch->base + ATA_REG_STATUS),
+             "c"(ATA_SR_BSY)
+             : "al"
+             : nodata_loop);
+    ide_write(channel, ATA_REG_CONTROL, ch->nIEN = 0);  // Enable IRQs.
+    ide_write(channel, ATA_REG_HDDEVSEL,
+              (uint8_t)(0xE0 | (ide_devices[req->drive].Drive << 4)));
+    ch->drive = req->drive;
+    ch->active = ch->seg = req;
+    ch->state = IDE_NODATA;
+    if(req->direction == ATA_FLUSH) {
         ide_write(channel, ATA_REG_COMMAND,
-                  (uint8_t[]){ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH,
-                              ATA_CMD_CACHE_FLUSH_EXT}[lba_mode]);
-        ide_polling(channel, 0);  // Polling.
+                  lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+    } else {
+        ide_write(channel, ATA_REG_FEATURES, (uint8_t)req->lba);
+        ide_write(channel, ATA_REG_COMMAND, ATA_CMD_SET_FEATURES);
     }
+}
 
-    return 0;  // Easy, isn't it?
+// DATA SET MANAGEMENT with the TRIM bit. The ranges in req->buf go out by
+// DMA like a write, the LBA registers are unused.
+static uint8_t ide_ata_trim(uint8_t channel, ide_request_t *req) {
+    struct IDEChannelRegisters *ch = &channels[channel];
+    if(ide_build_prdt(channel, req)) return 1;
+    ide_write(channel, ATA_REG_CONTROL, ch->nIEN = 0);  // Enable IRQs.
+trim_loop:
+    asm goto("in al,dx\ntest al,cl\njnz %l2" ::"d"(ch->base + ATA_REG_STATUS),
+             "c"(ATA_SR_BSY)
+             : "al"
+             : trim_loop);
+    outl(ch->bmide + ATA_REG_BMPRDT - 0x0E,
+         get_physaddr((uint32_t)ide_prdt[channel]));
+    ide_write(channel, ATA_REG_BMCOMMAND, 0);
+    ide_write(channel, ATA_REG_BMSTATUS,
+              ide_read(channel, ATA_REG_BMSTATUS) | ATA_BM_SR_ERR
+                | ATA_BM_SR_INTR);  // Clear Error and Interrupt bits.
+    ide_write(channel, ATA_REG_HDDEVSEL,
+              (uint8_t)(0xE0 | (ide_devices[req->drive].Drive << 4)));
+    ide_write(channel, ATA_REG_FEATURES, 0);  // High byte first in LBA48.
+    ide_write(channel, ATA_REG_FEATURES, ATA_DSM_TRIM);
+    ide_write(channel, ATA_REG_SECCOUNT1, (uint8_t)(req->count >> 8));
+    ide_write(channel, ATA_REG_LBA3, 0);
+    ide_write(channel, ATA_REG_LBA4, 0);
+    ide_write(channel, ATA_REG_LBA5, 0);
+    ide_write(channel, ATA_REG_SECCOUNT0, (uint8_t)req->count);
+    ide_write(channel, ATA_REG_LBA0, 0);
+    ide_write(channel, ATA_REG_LBA1, 0);
+    ide_write(channel, ATA_REG_LBA2, 0);
+    ch->drive = req->drive;
+    ch->active = ch->seg = req;
+    ch->state = IDE_DMA;
+    ide_write(channel, ATA_REG_COMMAND, ATA_CMD_DSM);
+    ide_write(channel, ATA_REG_BMCOMMAND, ATA_BM_CMD_START);
+    return 0;
 }
 
-uint8_t ide_read_sectors(uint8_t drive, uint8_t numsects, uint32_t lba,
-                         uint8_t *buf) {
+static uint8_t ide_atapi_start(uint8_t channel, ide_request_t *req) {
+    struct IDEChannelRegisters *ch = &channels[channel];
+    uint8_t drive = req->drive, dma, err;
+    uint8_t packet[12] = {0}, *p = packet;
+    uint32_t lba = (uint32_t)req->lba, numsects = 0, words = 6;
+    uint16_t units = ide_devices[drive].SectorSize / 512;
+    for(ide_request_t *r = req; r; r = r->merged) numsects += r->count;
+
+    ide_write(channel, ATA_REG_CONTROL, ch->nIEN = 0);  // Enable IRQs.
+
+    // (I) Build the SCSI command, READ(10) has a 16-bit transfer length:
+    packet[0] = numsects > 0xFFFF ? ATAPI_CMD_READ12 : ATAPI_CMD_READ10;
+    packet[2] = (uint8_t)(lba >> 24);
+    packet[3] = (uint8_t)(lba >> 16);
+    packet[4] = (uint8_t)(lba >> 8);
+    packet[5] = (uint8_t)lba;
+    if(packet[0] == ATAPI_CMD_READ12) {
+        packet[6] = (uint8_t)(numsects >> 24);
+        packet[7] = (uint8_t)(numsects >> 16);
+        packet[8] = (uint8_t)(numsects >> 8);
+        packet[9] = (uint8_t)numsects;
+    } else {
+        packet[7] = (uint8_t)(numsects >> 8);
+        packet[8] = (uint8_t)numsects;
+    }
+
+    // (II) DMA if the buffers can be described by a PRD table;
+    dma = ide_devices[drive].Dma && ide_build_prdt(channel, req) == 0;
+
+    // (III) Wait if the drive is busy;
+atapi_loop:
+    asm goto("in al,dx\ntest al,cl\njnz %l2" ::"d"(ch->base + ATA_REG_STATUS),
+             "c"(ATA_SR_BSY)
+             : "al"
+             : atapi_loop);
+
+    if(dma) {
+        outl(ch->bmide + ATA_REG_BMPRDT - 0x0E,
+             get_physaddr((uint32_t)ide_prdt[channel]));
+        ide_write(channel, ATA_REG_BMCOMMAND, ATA_BM_CMD_READ);
+        ide_write(channel, ATA_REG_BMSTATUS,
+                  ide_read(channel, ATA_REG_BMSTATUS) | ATA_BM_SR_ERR
+                    | ATA_BM_SR_INTR);  // Clear Error and Interrupt bits.
+    }
+
+    // (IV) Select Drive, DMA flag and the PIO byte count of a DRQ block;
+    ide_write(channel, ATA_REG_HDDEVSEL,
+              (uint8_t)(0xA0 | (ide_devices[drive].Drive << 4)));
+    ide_write(channel, ATA_REG_FEATURES, dma);
+    ide_write(channel, ATA_REG_LBA1, (uint8_t)ide_devices[drive].SectorSize);
+    ide_write(channel, ATA_REG_LBA2,
+              (uint8_t)(ide_devices[drive].SectorSize >> 8));
+
+    // (V) Prepare the channel, PIO moves one sector per DRQ block.
+    ch->drive = drive;
+    ch->active = ch->seg = req;
+    ch->buf = req->buf;
+    ch->left = req->count * units;
+    ch->total = numsects * units;
+    ch->multiple = (uint8_t)units;
+    ch->io32 = 0;
+    ch->state = dma ? IDE_DMA : IDE_PACKET;
+    ide_write(channel, ATA_REG_COMMAND, ATA_CMD_PACKET);
+
+    // (VI) Send the packet once the drive asks for it with DRQ;
+    if((err = ide_polling(channel, 1)) != 0) {
+        ch->state = IDE_IDLE;
+        return err;
+    }
+    asm volatile("rep outsw"
+                 : "+S"(p), "+c"(words)
+                 : "d"(ch->base)
+                 : "memory");
+    if(dma)
+        ide_write(channel, ATA_REG_BMCOMMAND,
+                  ATA_BM_CMD_READ | ATA_BM_CMD_START);
+    return 0;
+}
+
+// Advances to the buffer of the next merged request.
+static void ide_next_sector(struct IDEChannelRegisters *ch) {
+    if(--ch->left || ch->seg->merged == 0) return;
+    ch->seg = ch->seg->merged;
+    ch->buf = ch->seg->buf;
+    ch->left = ch->seg->count;
+}
+
+// Moves one DRQ block, sector by sector as it may span merged requests.
+static void ide_pio_block(struct IDEChannelRegisters *ch, uint8_t direction) {
+    uint32_t n = min(ch->multiple, ch->total);
+    ch->total -= n;
+    while(n--) {
+        uint32_t count = ch->io32 ? 128 : 256;
+        if(direction == ATA_READ && ch->io32)
+            asm volatile("rep insd"
+                         : "+D"(ch->buf), "+c"(count)
+                         : "d"(ch->base)
+                         : "memory");  // Receive Data
+        else if(direction == ATA_READ)
+            asm volatile("rep insw"
+                         : "+D"(ch->buf), "+c"(count)
+                         : "d"(ch->base)
+                         : "memory");  // Receive Data
+        else if(ch->io32)
+            asm volatile("rep outsd"
+                         : "+S"(ch->buf), "+c"(count)
+                         : "d"(ch->base)
+                         : "memory");  // Send Data
+        else
+            asm volatile("rep outsw"
+                         : "+S"(ch->buf), "+c"(count)
+                         : "d"(ch->base)
+                         : "memory");  // Send Data
+        ide_next_sector(ch);
+    }
+}
+
+static void ide_complete(uint8_t channel, uint8_t err) {
+    struct IDEChannelRegisters *ch = &channels[channel];
+    ide_request_t *req = ch->active;
+    // A flush covers only writes completed before it was issued, and being
+    // a barrier it runs with no other write queued or in flight.
+    if(err == 0 && req->direction == ATA_WRITE) ide_dirty[ch->drive] = 1;
+    if(err == 0 && req->direction == ATA_FLUSH) ide_dirty[ch->drive] = 0;
+    ch->active = ch->seg = 0;
+    ch->state = IDE_IDLE;
+    err = ide_print_error(ch->drive, err);
+    while(req) {
+        ide_request_t *next = req->merged;
+        req->merged = 0;
+        req->err = err;
+        req->done = 1;
+        if(req->callback) req->callback(req);
+        req = next;
+    }
+    ide_dispatch(channel);
+}
+
+static void ide_irq(uint8_t channel) {
+    struct IDEChannelRegisters *ch = &channels[channel];
+    uint8_t bm = 0, state;
+    if(ch->state == IDE_DMA) bm = ide_read(channel, ATA_REG_BMSTATUS);
+    if(ide_read(channel, ATA_REG_ALTSTATUS) & ATA_SR_BSY) return;
+    state = ide_read(channel, ATA_REG_STATUS);  // Acknowledge the IRQ.
+
+    switch(ch->state) {
+    case IDE_DMA:
+        if((bm & ATA_BM_SR_ACTIVE)
+           && !(bm & (ATA_BM_SR_INTR | ATA_BM_SR_ERR)))
+            return;  // Transfer still running.
+        ide_write(channel, ATA_REG_BMCOMMAND, 0);  // Stop Bus Master.
+        ide_write(channel, ATA_REG_BMSTATUS,
+                  bm | ATA_BM_SR_ERR | ATA_BM_SR_INTR);  // Clear status.
+        if(state & ATA_SR_ERR) ide_complete(channel, 2);
+        else if((state & ATA_SR_DF) || (bm & ATA_BM_SR_ERR))
+            ide_complete(channel, 1);
+        else
+            ide_complete(channel, 0);
+        break;
+    case IDE_PIO_READ:
+        if(state & ATA_SR_ERR) ide_complete(channel, 2);
+        else if(state & ATA_SR_DF)
+            ide_complete(channel, 1);
+        else if((state & ATA_SR_DRQ) == 0)
+            ide_complete(channel, 3);
+        else {
+            ide_pio_block(ch, ATA_READ);
+            if(ch->total == 0) ide_complete(channel, 0);
+        }
+        break;
+    case IDE_PIO_WRITE:
+        if(state & ATA_SR_ERR) ide_complete(channel, 2);
+        else if(state & ATA_SR_DF)
+            ide_complete(channel, 1);
+        else if(ch->total == 0)
+            ide_complete(channel, 0);  // Last block accepted.
+        else if((state & ATA_SR_DRQ) == 0)
+            ide_complete(channel, 3);
+        else
+            ide_pio_block(ch, ATA_WRITE);
+        break;
+    case IDE_PACKET:
+        if(state & ATA_SR_ERR) ide_complete(channel, 2);
+        else if(state & ATA_SR_DF)
+            ide_complete(channel, 1);
+        else if((state & ATA_SR_DRQ) == 0)
+            ide_complete(channel, ch->total ? 3 : 0);  // Status phase.
+        else if(ch->total)
+            ide_pio_block(ch, ATA_READ);
+        else
+            ide_complete(channel, 3);  // More data than requested.
+        break;
+    case IDE_NODATA:
+        if(state & ATA_SR_ERR) ide_complete(channel, 2);
+        else if(state & ATA_SR_DF)
+            ide_complete(channel, 1);
+        else
+            ide_complete(channel, 0);
+        break;
+    default: break;  // Spurious IRQ, nothing in flight.
+    }
+}
+
+void do_irq14(void) { ide_irq(ATA_PRIMARY); }
+void do_irq15(void) { ide_irq(ATA_SECONDARY); }
+
+uint32_t ide_max_sectors(uint8_t drive) {
+    if(ide_devices[drive].Type == IDE_ATAPI) return IDE_MAX_SECTORS_ATAPI;
+    if(ide_devices[drive].CommandSets & (1 << 26))
+        return IDE_MAX_SECTORS_LBA48;
+    return IDE_MAX_SECTORS_LBA28;
+}
+
+// Pending list is kept sorted by (drive, LBA).
+static uint8_t ide_request_before(const ide_request_t *a, uint8_t drive,
+                                  uint64_t lba) {
+    return a->drive < drive || (a->drive == drive && a->lba < lba);
+}
+
+static void ide_queue_insert(struct IDEChannelRegisters *ch,
+                             ide_request_t *req) {
+    ide_request_t **p = &ch->queue;
+    // Equal keys keep submission order.
+    while(*p && !ide_request_before(req, (*p)->drive, (*p)->lba))
+        p = &(*p)->next;
+    req->next = *p;
+    *p = req;
+}
+
+// Overlapping pending write makes reordering unsafe.
+static uint8_t ide_queue_conflict(struct IDEChannelRegisters *ch,
+                                  const ide_request_t *req) {
+    for(ide_request_t *r = ch->queue; r; r = r->next)
+        if(r->drive == req->drive
+           && (r->direction == ATA_WRITE || req->direction == ATA_WRITE)
+           && r->lba < req->lba + req->count && req->lba < r->lba + r->count)
+            return 1;
+    return 0;
+}
+
+// C-LOOK: serve requests above the last position in ascending order, then
+// wrap around to the lowest one. Adjacent requests become one command.
+static void ide_dispatch(uint8_t channel) {
+    struct IDEChannelRegisters *ch = &channels[channel];
+    while(ch->state == IDE_IDLE && ch->queue) {
+        ide_request_t **p = &ch->queue;
+        while(*p && ide_request_before(*p, ch->pos_drive, ch->pos_lba))
+            p = &(*p)->next;
+        if(*p == 0) p = &ch->queue;
+        ide_request_t *req = *p, *last = req;
+        uint32_t count = req->count;
+        *p = req->next;
+        req->merged = 0;
+        while(req->direction <= ATA_WRITE && *p
+              && (*p)->drive == req->drive
+              && (*p)->direction == req->direction
+              && (*p)->lba == last->lba + last->count
+              && count + (*p)->count <= ide_max_sectors(req->drive)) {
+            last->merged = *p;
+            last = *p;
+            count += last->count;
+            *p = last->next;
+            last->merged = 0;
+        }
+        ch->pos_drive = req->drive;
+        ch->pos_lba = req->lba + count;
+        if(req->direction > ATA_WRITE && req->direction != ATA_TRIM) {
+            ide_ata_nodata(channel, req);
+            return;
+        }
+        uint8_t err = req->direction == ATA_TRIM ? ide_ata_trim(channel, req)
+                      : ide_devices[req->drive].Type == IDE_ATAPI
+                        ? ide_atapi_start(channel, req)
+                        : ide_ata_start(channel, req);
+        if(err) {
+            ch->active = req;
+            ide_complete(channel, err);
+            return;  // ide_complete dispatched the rest.
+        }
+    }
+}
+
+// Sleeps until the next IRQ, or when called with IRQs disabled drives the
+// state machine by polling.
+static void ide_idle(uint8_t channel) {
+    if(read_eflags() & EFLAGS_IF) asm("hlt");
+    else {
+        ide_read(channel, ATA_REG_ALTSTATUS);
+        ide_read(channel, ATA_REG_ALTSTATUS);
+        ide_read(channel, ATA_REG_ALTSTATUS);
+        ide_read(channel, ATA_REG_ALTSTATUS);
+        ide_irq(channel);
+    }
+}
+
+// Waits for the command in flight and everything queued behind it.
+static void ide_wait_channel(uint8_t channel) {
+    while(channels[channel].state != IDE_IDLE) ide_idle(channel);
+}
+
+uint8_t ide_submit(ide_request_t *req) {
+    uint8_t drive = req->drive;
+    req->done = 0;
+    req->err = 0;
+    req->merged = 0;
     if(drive > 3 || ide_devices[drive].Reserved == 0)
-        return 1;  // Drive Not Found!
-    if(((lba + numsects) > ide_devices[drive].Size)
-       && (ide_devices[drive].Type == IDE_ATA))
-        return 2;  // Seeking to invalid position.
-    uint8_t err = 0;
-    if(ide_devices[drive].Type == IDE_ATA)
-        err = ide_ata_access(ATA_READ, drive, lba, numsects, buf);
-    else if(ide_devices[drive].Type == IDE_ATAPI)
-        return 3;  // Not Implemented.
-    else
-        return 1;
-    return ide_print_error(drive, err);
+        req->err = 1;  // Drive Not Found!
+    else if(ide_devices[drive].Type == IDE_ATAPI
+            && req->direction != ATA_READ)
+        req->err = req->direction == ATA_WRITE ? ide_print_error(drive, 4) : 1;
+    else if((req->lba + req->count) > ide_devices[drive].Size)
+        req->err = 2;  // Seeking to invalid position.
+    else if(req->direction <= ATA_WRITE
+            && (req->count == 0 || req->count > ide_max_sectors(drive)))
+        req->err = 1;
+    if(req->err) {
+        req->done = 1;
+        if(req->callback) req->callback(req);
+        return req->err;
+    }
+    uint8_t channel = ide_devices[drive].Channel;
+    struct IDEChannelRegisters *ch = &channels[channel];
+    uint32_t flags = read_eflags();
+    while(1) {
+        asm("cli");
+        // Non-data commands are barriers, everything before them completes.
+        if(req->direction > ATA_WRITE
+             ? (ch->queue == 0 && ch->state == IDE_IDLE)
+             : !ide_queue_conflict(ch, req))
+            break;
+        if(flags & EFLAGS_IF) asm("sti");
+        ide_wait_channel(channel);
+    }
+    ide_queue_insert(ch, req);
+    ide_dispatch(channel);
+    if(flags & EFLAGS_IF) asm("sti");
+    return 0;
+}
+
+uint8_t ide_wait_request(ide_request_t *req) {
+    while(!req->done) ide_idle(ide_devices[req->drive].Channel);
+    return req->err;
+}
+
+// Splits the transfer into commands the drive accepts, keeping the next
+// one queued while the current one runs.
+static uint8_t ide_sync(uint8_t direction, uint8_t drive, uint32_t numsects,
+                        uint64_t lba, uint8_t *buf) {
+    ide_request_t req[2];
+    uint32_t max = drive > 3 ? 1 : ide_max_sectors(drive),
+             ss = drive > 3 ? 512 : ide_devices[drive].SectorSize;
+    uint8_t n = 0, err = 0;
+    req[0].done = req[1].done = 1;
+    req[0].err = req[1].err = 0;
+    if(numsects == 0) return 0;
+    while(numsects && err == 0) {
+        uint32_t count = min(numsects, max);
+        err = ide_wait_request(&req[n]);
+        if(err) break;
+        req[n] = (ide_request_t){.direction = direction,
+                                 .drive = drive,
+                                 .lba = lba,
+                                 .count = count,
+                                 .buf = buf,
+                                 .callback = 0};
+        if(ide_submit(&req[n])) err = req[n].err;
+        lba += count;
+        buf += count * ss;
+        numsects -= count;
+        n ^= 1;
+    }
+    uint8_t err0 = ide_wait_request(&req[0]), err1 = ide_wait_request(&req[1]);
+    if(err == 0) err = err0 ? err0 : err1;
+    return err;
 }
 
-uint8_t ide_write_sectors(uint8_t drive, uint8_t numsects, uint32_t lba,
+uint8_t ide_read_sectors(uint8_t drive, uint32_t numsects, uint64_t lba,
+                         uint8_t *buf) {
+    return ide_sync(ATA_READ, drive, numsects, lba, buf);
+}
+
+uint8_t ide_write_sectors(uint8_t drive, uint32_t numsects, uint64_t lba,
                           const uint8_t *buf) {
-    if(drive > 3 || ide_devices[drive].Reserved == 0)
-        return 1;  // Drive Not Found!
-    if(((lba + numsects) > ide_devices[drive].Size)
-       && (ide_devices[drive].Type == IDE_ATA))
-        return 2;  // Seeking to invalid position.
-    uint8_t err = 0;
-    if(ide_devices[drive].Type == IDE_ATA)
-        err = ide_ata_access(ATA_WRITE, drive, lba, numsects, (void *)buf);
-    else if(ide_devices[drive].Type == IDE_ATAPI)
-        err = 4;  // Write-Protected.
-    else
-        return 1;
-    return ide_print_error(drive, err);
-}
\ No newline at end of file
+    return ide_sync(ATA_WRITE, drive, numsects, lba, (void *)buf);
+}
+
+// Barrier, returns when everything written before reached the media.
+uint8_t ide_flush(uint8_t drive) {
+    if(drive > 3 || ide_devices[drive].Reserved == 0) return 1;
+    if(ide_devices[drive].Type != IDE_ATA) return 0;
+    // Writes still queued or in flight, e.g. from ide_submit, count as dirty.
+    struct IDEChannelRegisters *ch = &channels[ide_devices[drive].Channel];
+    uint32_t flags = read_eflags();
+    asm("cli");
+    uint8_t dirty = ide_dirty[drive];
+    if(ch->active && ch->active->drive == drive
+       && ch->active->direction == ATA_WRITE)
+        dirty = 1;
+    for(ide_request_t *r = ch->queue; r; r = r->next)
+        if(r->drive == drive && r->direction == ATA_WRITE) dirty = 1;
+    if(flags & EFLAGS_IF) asm("sti");
+    if(!dirty) return 0;
+    ide_request_t req = {.direction = ATA_FLUSH, .drive = drive};
+    if(ide_submit(&req)) return req.err;
+    return ide_wait_request(&req);
+}
+
+// Discards count sectors from lba. Like flushes, trims are barriers, so they
+// never pass a queued write to the same sectors.
+uint8_t ide_trim(uint8_t drive, uint64_t lba, uint32_t count) {
+    if(drive > 3 || ide_devices[drive].Reserved == 0) return 1;
+    if(lba + count > ide_devices[drive].Size) return 2;
+    if(!ide_devices[drive].Trim) return 0;
+    uint64_t ranges[IDE_TRIM_RANGES];
+    while(count) {
+        for(uint8_t i = 0; i < IDE_TRIM_RANGES; i++) {
+            uint32_t n = min(count, IDE_TRIM_RANGE_MAX);
+            ranges[i] = n ? lba | ((uint64_t)n << 48) : 0;
+            lba += n;
+            count -= n;
+        }
+        ide_request_t req = {.direction = ATA_TRIM,
+                             .drive = drive,
+                             .count = 1,
+                             .buf = (uint8_t *)ranges};
+        if(ide_submit(&req)) return req.err;
+        uint8_t err = ide_wait_request(&req);
+        if(err) return err;
+    }
+    return 0;
+}
+
+uint8_t ide_write_cache(uint8_t drive, uint8_t enable) {
+    if(drive > 3 || ide_devices[drive].Reserved == 0) return 1;
+    if(!enable) ide_flush(drive);
+    ide_request_t req = {.direction = ATA_FEATURES,
+                         .drive = drive,
+                         .lba = enable ? ATA_FEATURE_WCACHE_ON
+                                       : ATA_FEATURE_WCACHE_OFF};
+    if(ide_submit(&req)) return req.err;
+    return ide_wait_request(&req);
+}
+
+static uint8_t ide_blk_read(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                            uint8_t *buf) {
+    return ide_read_sectors(((drv_ide_data_t *)drv->drv_data)->drive, count,
+                            lba, buf);
+}
+
+static uint8_t ide_blk_write(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                             const uint8_t *buf) {
+    return ide_write_sectors(((drv_ide_data_t *)drv->drv_data)->drive, count,
+                             lba, buf);
+}
+
+static uint8_t ide_blk_flush(drv_blk_t *drv) {
+    return ide_flush(((drv_ide_data_t *)drv->drv_data)->drive);
+}
+
+static uint8_t ide_blk_trim(drv_blk_t *drv, uint64_t lba, uint32_t count) {
+    return ide_trim(((drv_ide_data_t *)drv->drv_data)->drive, lba, count);
+}
+
+void drv_ide_blk_init(drv_blk_t *drv) {
+    drv_ide_data_t *data = drv->drv_data;
+    uint8_t ata = ide_devices[data->drive].Type == IDE_ATA;
+    drv->sector_size = ide_devices[data->drive].SectorSize;
+    drv->size = ide_devices[data->drive].Size;
+    drv->read = ide_blk_read;
+    drv->write = ata ? ide_blk_write : 0;  // CD/DVD drives are read-only.
+    drv->flush = ata ? ide_blk_flush : 0;
+    drv->trim = ide_devices[data->drive].Trim ? ide_blk_trim : 0;
+}
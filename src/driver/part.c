@@ -0,0 +1,160 @@
+#include "drivers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PART_MAX_LOGICAL 16
+#define PART_MAX_GPT     128
+
+// GPT partition type GUIDs in on-disk byte order.
+static const uint8_t gpt_linux[16]
+  = {0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84, 0x72, 0x47,
+     0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4};
+static const uint8_t gpt_basic_data[16]
+  = {0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+     0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7};
+static const uint8_t gpt_efi_system[16]
+  = {0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,
+     0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B};
+
+static uint8_t part_read(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                         uint8_t *buf) {
+    drv_part_data_t *data = drv->drv_data;
+    return blkdev_read(data->parent, data->start + lba, count, buf);
+}
+static uint8_t part_write(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                          const uint8_t *buf) {
+    drv_part_data_t *data = drv->drv_data;
+    return blkdev_write(data->parent, data->start + lba, count, buf);
+}
+static uint8_t part_flush(drv_blk_t *drv) {
+    return blkdev_flush(((drv_part_data_t *)drv->drv_data)->parent);
+}
+static uint8_t part_trim(drv_blk_t *drv, uint64_t lba, uint32_t count) {
+    drv_part_data_t *data = drv->drv_data;
+    return blkdev_trim(data->parent, data->start + lba, count);
+}
+
+void drv_part_init(drv_blk_t *drv) {
+    drv_part_data_t *data = drv->drv_data;
+    drv->sector_size = data->parent->sector_size;
+    drv->read = part_read;
+    drv->write = data->parent->write ? part_write : 0;
+    drv->flush = part_flush;
+    drv->trim = part_trim;
+    drv->name = data->name;
+}
+
+drv_blk_t *part_parent(drv_blk_t *drv) {
+    if(drv == 0 || drv->read != part_read) return 0;
+    return ((drv_part_data_t *)drv->drv_data)->parent;
+}
+
+// Registers partition n of dev, named like hda1 or ram0p1.
+static uint8_t part_add(drv_blk_t *dev, uint8_t n, uint64_t start,
+                        uint64_t count, uint8_t type) {
+    if(count == 0 || start >= dev->size || count > dev->size - start)
+        return 0;
+    drv_blk_t *drv = calloc(1, sizeof(drv_blk_t));
+    drv_part_data_t *data = calloc(1, sizeof(drv_part_data_t));
+    if(drv == 0 || data == 0) goto err;
+    uint32_t len = strlen(dev->name);
+    uint8_t digit
+      = len && dev->name[len - 1] >= '0' && dev->name[len - 1] <= '9';
+    snprintf(data->name, sizeof(data->name), "%s%s%u", dev->name,
+             digit ? "p" : "", n);
+    data->parent = dev;
+    data->start = start;
+    data->type = type;
+    drv->drv_data = data;
+    drv->size = count;
+    drv_part_init(drv);
+    if(blkdev_register(drv) == 0) return 1;
+err:
+    free(drv);
+    free(data);
+    return 0;
+}
+
+static uint8_t part_scan_gpt(drv_blk_t *dev, uint8_t *buf) {
+    if(blkdev_read(dev, 1, 1, buf) || memcmp(buf, "EFI PART", 8)) return 0;
+    uint64_t lba = *(uint64_t *)(buf + 72);
+    uint32_t entries = *(uint32_t *)(buf + 80),
+             esize = *(uint32_t *)(buf + 84), found = 0;
+    if(esize < 128 || esize > dev->sector_size || dev->sector_size % esize)
+        return 0;
+    uint32_t per_sector = dev->sector_size / esize;
+    for(uint32_t i = 0; i < entries && i < PART_MAX_GPT; i++) {
+        if(i % per_sector == 0
+           && blkdev_read(dev, lba + i / per_sector, 1, buf))
+            break;
+        uint8_t *e = buf + (i % per_sector) * esize, type = 0xFF;
+        uint8_t used = 0;
+        for(uint8_t j = 0; j < 16; j++) used |= e[j];
+        if(!used) continue;
+        // Known types map to their MBR counterparts.
+        if(memcmp(e, gpt_linux, 16) == 0) type = 0x83;
+        else if(memcmp(e, gpt_basic_data, 16) == 0)
+            type = 0x0C;
+        else if(memcmp(e, gpt_efi_system, 16) == 0)
+            type = 0xEF;
+        uint64_t first = *(uint64_t *)(e + 32), last = *(uint64_t *)(e + 40);
+        if(last >= first)
+            found += part_add(dev, (uint8_t)(i + 1), first, last - first + 1,
+                              type);
+    }
+    return (uint8_t)found;
+}
+
+// Logical partitions are numbered from 5, each EBR links to the next one
+// relative to the extended partition.
+static uint8_t part_scan_ebr(drv_blk_t *dev, uint8_t *buf, uint32_t base) {
+    uint8_t found = 0;
+    uint32_t ebr = base;
+    for(uint8_t n = 5; n < 5 + PART_MAX_LOGICAL; n++) {
+        if(blkdev_read(dev, ebr, 1, buf) || buf[510] != 0x55
+           || buf[511] != 0xAA)
+            break;
+        uint8_t *e = buf + 446;
+        if(e[4])
+            found += part_add(dev, n, ebr + *(uint32_t *)(e + 8),
+                              *(uint32_t *)(e + 12), e[4]);
+        if(e[16 + 4] == 0 || *(uint32_t *)(e + 16 + 8) == 0) break;
+        ebr = base + *(uint32_t *)(e + 16 + 8);
+    }
+    return found;
+}
+
+// A FAT boot sector also ends in 55 AA but has no partition table.
+static uint8_t part_is_vbr(const uint8_t *buf) {
+    return memcmp(buf + 0x36, "FAT", 3) == 0
+           || memcmp(buf + 0x52, "FAT", 3) == 0
+           || memcmp(buf + 3, "EXFAT", 5) == 0;
+}
+
+uint8_t part_scan(drv_blk_t *dev) {
+    if(dev == 0 || dev->sector_size != 512 || part_parent(dev)) return 0;
+    uint8_t *buf = malloc(dev->sector_size), table[64], found = 0;
+    if(buf == 0) return 0;
+    if(blkdev_read(dev, 0, 1, buf) || buf[510] != 0x55 || buf[511] != 0xAA
+       || part_is_vbr(buf)) {
+        free(buf);
+        return 0;
+    }
+    memcpy(table, buf + 446, sizeof(table));
+    for(uint8_t i = 0; i < 4; i++) {
+        uint8_t *e = table + i * 16;
+        uint32_t start = *(uint32_t *)(e + 8), count = *(uint32_t *)(e + 12);
+        if(e[4] == 0xEE) {
+            found = part_scan_gpt(dev, buf);
+            break;
+        }
+        if(e[4] == 0x05 || e[4] == 0x0F || e[4] == 0x85)
+            found += part_scan_ebr(dev, buf, start);
+        else if(e[4])
+            found += part_add(dev, i + 1, start, count, e[4]);
+    }
+    free(buf);
+    return found;
+}
@@ -0,0 +1,38 @@
+#include "drivers.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static uint8_t ramdisk_read(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                            uint8_t *buf) {
+    drv_ramdisk_data_t *data = drv->drv_data;
+    memcpy(buf, data->mem + (uint32_t)lba * drv->sector_size,
+           count * drv->sector_size);
+    return 0;
+}
+
+static uint8_t ramdisk_write(drv_blk_t *drv, uint64_t lba, uint32_t count,
+                             const uint8_t *buf) {
+    drv_ramdisk_data_t *data = drv->drv_data;
+    memcpy(data->mem + (uint32_t)lba * drv->sector_size, buf,
+           count * drv->sector_size);
+    return 0;
+}
+
+// Memory is not given back, discarded sectors just keep their contents.
+static uint8_t ramdisk_trim(drv_blk_t *drv, uint64_t lba, uint32_t count) {
+    (void)drv;
+    (void)lba;
+    (void)count;
+    return 0;
+}
+
+void drv_ramdisk_init(drv_blk_t *drv) {
+    drv_ramdisk_data_t *data = drv->drv_data;
+    drv->sector_size = 512;
+    drv->size = data->bytes / drv->sector_size;
+    drv->read = ramdisk_read;
+    drv->write = ramdisk_write;
+    drv->flush = 0;
+    drv->trim = ramdisk_trim;
+}
@@ -1,34 +1,120 @@
 #include "ext2.h"
 
-#include "disk.h"
-#include "driver/driver_fs.h"
+#include "bcache.h"
+#include "drivers.h"
 #include "kernel.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static void read_block_buf(drv_fs_ext2_data_t *data, uint8_t n,
-                           uint32_t block) {
-    if(data->buf_block[n] == block) return;
+// max_run of a group that had blocks freed since it was last scanned.
+#define EXT2_RUN_STALE 0xFFFFFFFF
+// Block mapped through an unreadable indirect or extent block, unlike the 0
+// of a hole.
+#define EXT2_MAP_ERROR 0xFFFFFFFF
+
+static bcache_buf_t *read_block(drv_fs_ext2_data_t *data, uint32_t block) {
+    if(block >= data->sb.s_blocks_count) return 0;
+    return bread(data->dev,
+                 data->fs_start + (block * (data->block_size / 512)),
+                 data->block_size);
+}
+// buf[n] points into a buffer cache block held until replaced.
+static uint8_t read_block_buf(drv_fs_ext2_data_t *data, uint8_t n,
+                              uint32_t block) {
+    if(data->buf_block[n] == block) return 0;
     // printf("read%u block %lu\n", n, block);
-    ide_read_sectors(0, (uint8_t)(data->block_size / 512),
-                     data->fs_start + (block * (data->block_size / 512)),
-                     data->buf[n]);
+    bcache_buf_t *b = read_block(data, block);
+    if(b == 0) return 1;
+    brelse(data->bbuf[n]);
+    data->bbuf[n] = b;
+    data->buf[n] = b->data;
     data->buf_block[n] = block;
+    return 0;
 }
-static void read_block_bgdt(drv_fs_ext2_data_t *data, uint32_t block) {
-    if(data->bgdtbuf_block == block) return;
-    // printf("readbgdt block %lu\n", block);
-    ide_read_sectors(0, (uint8_t)(data->block_size / 512),
-                     data->fs_start + (block * (data->block_size / 512)),
-                     (void *)data->bgdtbuf);
-    data->bgdtbuf_block = block;
+// Block group descriptors are decoded once at mount. 64bit filesystems
+// have larger descriptors starting with the same low halves.
+static uint8_t read_bgdt(drv_fs_ext2_data_t *data) {
+    uint32_t first = data->block_size == 1024 ? 2 : 1;
+    data->desc_size = sizeof(ext2_bgdt_t);
+    if((data->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+       && data->sb.s_desc_size > sizeof(ext2_bgdt_t))
+        data->desc_size = data->sb.s_desc_size;
+    data->bgdt = malloc(data->num_bgds * sizeof(ext2_bgdt_t));
+    if(data->bgdt == 0) return 1;
+    bcache_buf_t *b = 0;
+    for(uint32_t g = 0; g < data->num_bgds; g++) {
+        uint32_t off = g * data->desc_size;
+        if(off % data->block_size == 0) {
+            brelse(b);
+            b = read_block(data, first + off / data->block_size);
+            if(b == 0) {
+                free(data->bgdt);
+                data->bgdt = 0;
+                return 1;
+            }
+        }
+        memcpy(&data->bgdt[g], b->data + off % data->block_size,
+               sizeof(ext2_bgdt_t));
+    }
+    brelse(b);
+    return 0;
 }
 
-void ext2_init(drv_fs_ext2_data_t *data, uint32_t first_lba) {
-    ide_read_sectors(0, 2, first_lba + 2, (void *)&data->sb);
+static uint32_t ext2_group_blocks(drv_fs_ext2_data_t *data, uint32_t group) {
+    uint32_t first = data->sb.s_first_data_block
+                     + group * data->sb.s_blocks_per_group;
+    if(first >= data->sb.s_blocks_count) return 0;
+    return min(data->sb.s_blocks_per_group, data->sb.s_blocks_count - first);
+}
+// Longest run of clear bits among the first end bits of a bitmap.
+static uint32_t ext2_longest_run(const uint8_t *map, uint32_t end) {
+    uint32_t best = 0, run = 0;
+    for(uint32_t bit = 0; bit < end;) {
+        uint8_t byte = map[bit / 8];
+        if(bit % 8 == 0 && bit + 8 <= end && (byte == 0 || byte == 0xFF)) {
+            run = byte ? 0 : run + 8;
+            bit += 8;
+        } else {
+            run = (byte & (1 << (bit % 8))) ? 0 : run + 1;
+            bit++;
+        }
+        if(run > best) best = run;
+    }
+    return best;
+}
+static uint8_t ext2_scan_group(drv_fs_ext2_data_t *data, uint32_t group) {
+    bcache_buf_t *b = read_block(data, data->bgdt[group].bg_block_bitmap);
+    if(b == 0) return 1;
+    data->max_run[group]
+      = ext2_longest_run(b->data, ext2_group_blocks(data, group));
+    brelse(b);
+    return 0;
+}
+// Builds the free run summary. Read-only mounts may have uninitialized
+// ext4 bitmaps and keep the free count as the bound instead.
+static uint8_t ext2_scan_groups(drv_fs_ext2_data_t *data) {
+    data->max_run = malloc(data->num_bgds * sizeof(uint32_t));
+    if(data->max_run == 0) return 1;
+    for(uint32_t g = 0; g < data->num_bgds; g++) {
+        data->max_run[g] = data->bgdt[g].bg_free_blocks_count;
+        if(data->writable && data->max_run[g] && ext2_scan_group(data, g))
+            return 1;
+    }
+    return 0;
+}
+
+void ext2_init(drv_fs_ext2_data_t *data, drv_blk_t *dev, uint32_t first_lba) {
     data->ready = 0;
+    data->dev = dev;
+    data->bgdt = 0;
+    data->max_run = 0;
+    data->icache = 0;
+    data->dcache = 0;
+    data->bbuf[0] = data->bbuf[1] = 0;
+    for(uint8_t i = 0; i < EXT2_IND_CACHE; i++) data->ind_buf[i] = 0;
+    if(blkdev_read(dev, first_lba + 2, 2, (void *)&data->sb)) return;
     if(data->sb.s_magic != 0xEF53) return;
     uint32_t a, b;
     a = (data->sb.s_blocks_count / data->sb.s_blocks_per_group)
@@ -38,16 +124,59 @@ void ext2_init(drv_fs_ext2_data_t *data, uint32_t first_lba) {
     data->num_bgds = (a > b) ? a : b;
     data->fs_start = first_lba;
     data->block_size = 1024 << data->sb.s_log_block_size;
-    data->buf[0] = malloc(data->block_size);
-    data->buf[1] = malloc(data->block_size);
-    data->bgdtbuf = malloc(data->block_size);
-    if(!data->buf[0] || !data->buf[1] || !data->bgdtbuf)
-        printf("ext2 malloc error\n");
+    for(uint8_t i = 0; i < EXT2_IND_CACHE; i++) data->ind_block[i] = 0;
+    data->ind_next = 0;
     data->buf_block[0] = 0xFFFFFFFF;
     data->buf_block[1] = 0xFFFFFFFF;
-    data->bgdtbuf_block = 0xFFFFFFFF;
+    if(read_bgdt(data)) {
+        printf("ext2 bgdt error\n");
+        ext2_release(data);
+        return;
+    }
+    data->icache = calloc(EXT2_ICACHE, sizeof(ext2_icache_t));
+    data->dcache = calloc(EXT2_DCACHE, sizeof(ext2_dentry_t));
+    if(data->icache == 0 || data->dcache == 0) {
+        printf("ext2 malloc error\n");
+        ext2_release(data);
+        return;
+    }
+    for(uint32_t i = 0; i < EXT2_IHASH; i++) data->ihash[i] = 0;
+    for(uint32_t i = 0; i < EXT2_DHASH; i++) data->dhash[i] = 0;
+    data->iclock = data->dclock = 0;
+    data->sb_dirty = 0;
+    for(uint8_t i = 0; i < EXT2_TRIM_RUNS; i++) data->trim_count[i] = 0;
+    // Writes only touch structures this driver knows how to keep consistent.
+    data->writable
+      = dev->write
+        && (data->sb.s_rev_level == 0
+            || (!(data->sb.s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_FILETYPE)
+                && !(data->sb.s_feature_ro_compat
+                     & ~EXT2_FEATURE_RO_COMPAT_WRITABLE)));
+    if(ext2_scan_groups(data)) {
+        printf("ext2 bitmap error\n");
+        ext2_release(data);
+        return;
+    }
     data->ready = 1;
 }
+void ext2_release(drv_fs_ext2_data_t *data) {
+    for(uint8_t i = 0; i < EXT2_IND_CACHE; i++) {
+        brelse(data->ind_buf[i]);
+        data->ind_buf[i] = 0;
+    }
+    brelse(data->bbuf[0]);
+    brelse(data->bbuf[1]);
+    data->bbuf[0] = data->bbuf[1] = 0;
+    free(data->bgdt);
+    free(data->max_run);
+    free(data->icache);
+    free(data->dcache);
+    data->bgdt = 0;
+    data->max_run = 0;
+    data->icache = 0;
+    data->dcache = 0;
+    data->ready = 0;
+}
 void ext2_print_sb(drv_fs_ext2_data_t *data) {
     if(!data->ready) return;
     printf("ext2 s_inodes_count %lu\ns_blocks_count %lu\ns_r_blocks_count "
@@ -71,51 +200,554 @@ void ext2_print_sb(drv_fs_ext2_data_t *data) {
 }
 void ext2_print_bgdt(drv_fs_ext2_data_t *data) {
     if(!data->ready) return;
-    uint32_t sectors = data->num_bgds * sizeof(ext2_bgdt_t);
-    sectors = (sectors / 512) + ((sectors % 512) ? 1 : 0);
-    read_block_bgdt(data, data->block_size == 1024 ? 2 : 1);
     for(uint32_t i = 0; i < data->num_bgds; i++) {
         printf(
           "bg %lu\nbg_block_bitmap %lu\nbg_inode_bitmap %lu\nbg_inode_table "
           "%lu\nbg_free_blocks_count %u\nbg_free_inodes_count "
           "%u\nbg_used_dirs_count %u\n",
-          i, data->bgdtbuf[i].bg_block_bitmap, data->bgdtbuf[i].bg_inode_bitmap,
-          data->bgdtbuf[i].bg_inode_table,
-          data->bgdtbuf[i].bg_free_blocks_count,
-          data->bgdtbuf[i].bg_free_inodes_count,
-          data->bgdtbuf[i].bg_used_dirs_count);
+          i, data->bgdt[i].bg_block_bitmap, data->bgdt[i].bg_inode_bitmap,
+          data->bgdt[i].bg_inode_table, data->bgdt[i].bg_free_blocks_count,
+          data->bgdt[i].bg_free_inodes_count, data->bgdt[i].bg_used_dirs_count);
     }
 }
-static void ext2_print_inode(drv_fs_ext2_data_t *data, uint32_t i,
-                             const char *path) {
+static uint8_t ext2_read_inode(drv_fs_ext2_data_t *data, uint32_t i,
+                               ext2_inode_t *inode) {
     uint32_t group = (i - 1) / data->sb.s_inodes_per_group,
              index = ((i - 1) % data->sb.s_inodes_per_group)
                      * (data->sb.s_rev_level > 0 ? data->sb.s_inode_size : 128);
-    uint32_t group_blk = group / (data->block_size / sizeof(ext2_bgdt_t))
-                         + (data->block_size == 1024 ? 2 : 1);
-    read_block_bgdt(data, group_blk);
-    group %= (data->block_size / sizeof(ext2_bgdt_t));
     uint32_t block
-      = index / data->block_size + data->bgdtbuf[group].bg_inode_table;
+      = index / data->block_size + data->bgdt[group].bg_inode_table;
     index = index % data->block_size;
-    read_block_buf(data, 0, block);
-    // printf("group %lu:%lu block %lu\n", group, group_blk, block);
+    if(read_block_buf(data, 0, block)) return 1;
+    // printf("group %lu block %lu\n", group, block);
     // printf("inode %u %u\n", block, index);
-    ext2_inode_t inode;
-    memcpy(&inode, data->buf[0] + index, sizeof(ext2_inode_t));
-    if(inode.i_links_count == 0 || inode.i_links_count == 0xFFFF) return;
-    // printf("inode %lu tp %04X links %u ", i, inode.i_mode,
-    // inode.i_links_count); printf("inode %lu tp %04X\n", i, inode.i_mode);
-    if((inode.i_mode & 0xF000) == 0x4000) {
+    memcpy(inode, data->buf[0] + index, sizeof(ext2_inode_t));
+    return 0;
+}
+
+// Inode table block holding inode i, off receives the offset in it.
+static bcache_buf_t *ext2_inode_slot(drv_fs_ext2_data_t *data, uint32_t i,
+                                     uint32_t *off) {
+    uint32_t size = data->sb.s_rev_level > 0 ? data->sb.s_inode_size : 128;
+    uint32_t group = (i - 1) / data->sb.s_inodes_per_group,
+             index = ((i - 1) % data->sb.s_inodes_per_group) * size;
+    *off = index % data->block_size;
+    return read_block(data, index / data->block_size
+                              + data->bgdt[group].bg_inode_table);
+}
+static uint8_t ext2_write_inode(drv_fs_ext2_data_t *data, uint32_t i,
+                                const ext2_inode_t *inode) {
+    uint32_t off;
+    bcache_buf_t *b = ext2_inode_slot(data, i, &off);
+    if(b == 0) return 1;
+    memcpy(b->data + off, inode, sizeof(ext2_inode_t));
+    bdirty(b);
+    brelse(b);
+    return 0;
+}
+
+// Copies a changed descriptor into its table block, the superblock totals
+// go out with ext2_sync.
+static void ext2_group_dirty(drv_fs_ext2_data_t *data, uint32_t group) {
+    uint32_t first = data->block_size == 1024 ? 2 : 1,
+             off = group * data->desc_size;
+    bcache_buf_t *b = read_block(data, first + off / data->block_size);
+    if(b) {
+        memcpy(b->data + off % data->block_size, &data->bgdt[group],
+               sizeof(ext2_bgdt_t));
+        bdirty(b);
+        brelse(b);
+    }
+    data->sb_dirty = 1;
+}
+
+// Sets or clears a bit of a bitmap block, 0 when it already was that way.
+static uint8_t ext2_set_bit(drv_fs_ext2_data_t *data, uint32_t map,
+                            uint32_t bit, uint8_t set) {
+    bcache_buf_t *b = read_block(data, map);
+    if(b == 0) return 0;
+    uint8_t mask = (uint8_t)(1 << (bit % 8)), *p = b->data + bit / 8;
+    uint8_t changed = set ? !(*p & mask) : !!(*p & mask);
+    if(changed) {
+        *p = set ? (uint8_t)(*p | mask) : (uint8_t)(*p & ~mask);
+        bdirty(b);
+    }
+    brelse(b);
+    return changed;
+}
+// First clear bit in start..end-1, or end. With whole only bits starting a
+// completely free byte are taken, so new files begin on a free run.
+static uint32_t ext2_find_zero(const uint8_t *map, uint32_t start,
+                               uint32_t end, uint8_t whole) {
+    uint32_t bit = start;
+    while(bit < end) {
+        if(whole) {
+            if(bit % 8 == 0 && bit + 8 <= end && map[bit / 8] == 0) return bit;
+            bit = (bit + 8) & ~7u;
+        } else if(bit % 8 == 0 && map[bit / 8] == 0xFF)
+            bit += 8;
+        else if(!(map[bit / 8] & (1 << (bit % 8))))
+            return bit;
+        else
+            bit++;
+    }
+    return end;
+}
+
+// Allocations keep max_run a valid bound by capping it, frees mark the
+// group for a rescan.
+static void ext2_count_blocks(drv_fs_ext2_data_t *data, uint32_t group,
+                              int32_t delta) {
+    data->bgdt[group].bg_free_blocks_count += delta;
+    data->sb.s_free_blocks_count += delta;
+    if(delta > 0)
+        data->max_run[group] = EXT2_RUN_STALE;
+    else if(data->max_run[group] > data->bgdt[group].bg_free_blocks_count)
+        data->max_run[group] = data->bgdt[group].bg_free_blocks_count;
+    ext2_group_dirty(data, group);
+}
+
+// Freed blocks are discarded in runs once ext2_sync has written the bitmaps
+// freeing them, before that a crash would leave them in use. Blocks that
+// are allocated again in the meantime leave their run.
+static void ext2_trim_flush(drv_fs_ext2_data_t *data) {
+    uint32_t spb = data->block_size / 512;
+    for(uint8_t n = 0; n < EXT2_TRIM_RUNS; n++) {
+        if(data->trim_count[n] == 0) continue;
+        bcache_trim(data->dev,
+                    data->fs_start + (uint64_t)data->trim_start[n] * spb,
+                    data->trim_count[n] * spb);
+        data->trim_count[n] = 0;
+    }
+}
+static void ext2_trim_add(drv_fs_ext2_data_t *data, uint32_t block) {
+    uint32_t *start = data->trim_start, *count = data->trim_count;
+    uint8_t slot = EXT2_TRIM_RUNS;
+    for(uint8_t n = 0; n < EXT2_TRIM_RUNS; n++) {
+        if(count[n] == 0) {
+            if(slot == EXT2_TRIM_RUNS) slot = n;
+        } else if(block == start[n] + count[n]) {
+            count[n]++;
+            return;
+        } else if(block + 1 == start[n]) {
+            start[n]--;
+            count[n]++;
+            return;
+        }
+    }
+    // Without a free slot the block is just not discarded.
+    if(slot == EXT2_TRIM_RUNS) return;
+    start[slot] = block;
+    count[slot] = 1;
+}
+static void ext2_trim_take(drv_fs_ext2_data_t *data, uint32_t block) {
+    uint32_t *start = data->trim_start, *count = data->trim_count;
+    for(uint8_t n = 0; n < EXT2_TRIM_RUNS; n++) {
+        if(count[n] == 0 || block < start[n] || block >= start[n] + count[n])
+            continue;
+        uint32_t tail = start[n] + count[n] - block - 1;
+        count[n] = block - start[n];
+        if(tail == 0) return;
+        uint8_t m = n;
+        if(count[n])
+            for(m = 0; m < EXT2_TRIM_RUNS && count[m]; m++)
+                ;
+        // Out of slots only the longer half stays pending.
+        if(m == EXT2_TRIM_RUNS) {
+            if(tail <= count[n]) return;
+            m = n;
+        }
+        start[m] = block + 1;
+        count[m] = tail;
+        return;
+    }
+}
+
+// Allocates the goal block if free, else the start of a free run after it in
+// its group, else a block in the following groups. Those are first tried
+// only where the summary promises a run of EXT2_PREALLOC blocks, so full
+// and fragmented groups are passed over without reading their bitmaps.
+static uint32_t ext2_alloc_block(drv_fs_ext2_data_t *data, uint32_t goal) {
+    uint32_t first = data->sb.s_first_data_block,
+             bpg = data->sb.s_blocks_per_group;
+    if(goal < first || goal >= data->sb.s_blocks_count) goal = first;
+    uint32_t g0 = (goal - first) / bpg, start = (goal - first) % bpg;
+    for(uint32_t n = 0; n < 2 * data->num_bgds; n++) {
+        uint32_t g = (g0 + n) % data->num_bgds;
+        uint32_t end = ext2_group_blocks(data, g);
+        if(data->bgdt[g].bg_free_blocks_count == 0 || end == 0) continue;
+        if(n && n < data->num_bgds && data->max_run[g] < EXT2_PREALLOC)
+            continue;
+        bcache_buf_t *b = read_block(data, data->bgdt[g].bg_block_bitmap);
+        if(b == 0) return 0;
+        if(data->max_run[g] == EXT2_RUN_STALE)
+            data->max_run[g] = ext2_longest_run(b->data, end);
+        uint32_t s = n ? 0 : start, bit = end;
+        if(s < end && !(b->data[s / 8] & (1 << (s % 8)))) bit = s;
+        // A free byte needs a run of 8, and without one the run is below 15.
+        if(bit == end && data->max_run[g] >= 8) {
+            bit = ext2_find_zero(b->data, s, end, 1);
+            if(bit == end && s == 0 && data->max_run[g] > 14)
+                data->max_run[g] = 14;
+        }
+        if(bit == end) bit = ext2_find_zero(b->data, s, end, 0);
+        if(bit == end) {
+            bit = ext2_find_zero(b->data, 0, s, 0);  // Wrap to the group start.
+            if(bit == s) bit = end;
+        }
+        if(bit < end) {
+            b->data[bit / 8] |= (uint8_t)(1 << (bit % 8));
+            bdirty(b);
+            brelse(b);
+            ext2_count_blocks(data, g, -1);
+            ext2_trim_take(data, first + g * bpg + bit);
+            return first + g * bpg + bit;
+        }
+        brelse(b);
+    }
+    return 0;
+}
+// Marks a specific block used, 0 when it is taken or out of range.
+static uint8_t ext2_take_block(drv_fs_ext2_data_t *data, uint32_t block) {
+    uint32_t first = data->sb.s_first_data_block,
+             bpg = data->sb.s_blocks_per_group;
+    if(block < first || block >= data->sb.s_blocks_count) return 0;
+    uint32_t g = (block - first) / bpg;
+    if(!ext2_set_bit(data, data->bgdt[g].bg_block_bitmap, (block - first) % bpg,
+                     1))
+        return 0;
+    ext2_count_blocks(data, g, -1);
+    ext2_trim_take(data, block);
+    return 1;
+}
+static void ext2_free_block(drv_fs_ext2_data_t *data, uint32_t block) {
+    uint32_t first = data->sb.s_first_data_block,
+             bpg = data->sb.s_blocks_per_group;
+    if(block < first || block >= data->sb.s_blocks_count) return;
+    // A freed indirect block must not stay pinned by the mapping cache.
+    for(uint8_t n = 0; n < EXT2_IND_CACHE; n++)
+        if(data->ind_block[n] == block && data->ind_buf[n]) {
+            brelse(data->ind_buf[n]);
+            data->ind_buf[n] = 0;
+        }
+    uint32_t g = (block - first) / bpg;
+    if(ext2_set_bit(data, data->bgdt[g].bg_block_bitmap, (block - first) % bpg,
+                    0)) {
+        ext2_count_blocks(data, g, 1);
+        ext2_trim_add(data, block);
+    }
+}
+
+// Inodes go to the parent's group when it has room.
+static uint32_t ext2_alloc_inode(drv_fs_ext2_data_t *data, uint32_t dir) {
+    uint32_t ipg = data->sb.s_inodes_per_group, g0 = (dir - 1) / ipg;
+    uint32_t first_ino = data->sb.s_rev_level > 0 ? data->sb.s_first_ino : 11;
+    for(uint32_t n = 0; n < data->num_bgds; n++) {
+        uint32_t g = (g0 + n) % data->num_bgds;
+        if(data->bgdt[g].bg_free_inodes_count == 0) continue;
+        bcache_buf_t *b = read_block(data, data->bgdt[g].bg_inode_bitmap);
+        if(b == 0) return 0;
+        uint32_t bit = ext2_find_zero(b->data, g ? 0 : first_ino - 1, ipg, 0);
+        if(bit < ipg) {
+            b->data[bit / 8] |= (uint8_t)(1 << (bit % 8));
+            bdirty(b);
+            brelse(b);
+            data->bgdt[g].bg_free_inodes_count--;
+            data->sb.s_free_inodes_count--;
+            ext2_group_dirty(data, g);
+            return g * ipg + bit + 1;
+        }
+        brelse(b);
+    }
+    return 0;
+}
+static void ext2_free_inode(drv_fs_ext2_data_t *data, uint32_t i) {
+    uint32_t ipg = data->sb.s_inodes_per_group, g = (i - 1) / ipg;
+    if(ext2_set_bit(data, data->bgdt[g].bg_inode_bitmap, (i - 1) % ipg, 0)) {
+        data->bgdt[g].bg_free_inodes_count++;
+        data->sb.s_free_inodes_count++;
+        ext2_group_dirty(data, g);
+    }
+}
+
+// Returns the unused preallocated blocks of an inode to the bitmap.
+static void ext2_discard_prealloc(drv_fs_ext2_data_t *data,
+                                  ext2_icache_t *ic) {
+    while(ic->prealloc_count) {
+        ext2_free_block(data, ic->prealloc++);
+        ic->prealloc_count--;
+    }
+}
+
+// Returns the cached inode with a reference, loading it on a miss into the
+// least recently used unreferenced entry.
+static ext2_icache_t *ext2_iget(drv_fs_ext2_data_t *data, uint32_t i) {
+    if(i == 0 || i > data->sb.s_inodes_count) return 0;
+    ext2_icache_t **bucket = &data->ihash[i % EXT2_IHASH], *ic, *lru = 0;
+    for(ic = *bucket; ic; ic = ic->hnext)
+        if(ic->ino == i) {
+            ic->refs++;
+            ic->used = ++data->iclock;
+            return ic;
+        }
+    for(uint32_t n = 0; n < EXT2_ICACHE; n++) {
+        ext2_icache_t *e = &data->icache[n];
+        if(e->refs == 0 && (lru == 0 || e->used < lru->used)) lru = e;
+    }
+    if(lru == 0) return 0;
+    if(lru->prealloc_count) ext2_discard_prealloc(data, lru);
+    if(lru->ino) {
+        ext2_icache_t **p = &data->ihash[lru->ino % EXT2_IHASH];
+        while(*p != lru) p = &(*p)->hnext;
+        *p = lru->hnext;
+        lru->ino = 0;
+    }
+    if(ext2_read_inode(data, i, &lru->inode)) return 0;
+    lru->ino = i;
+    lru->refs = 1;
+    lru->used = ++data->iclock;
+    lru->hnext = *bucket;
+    *bucket = lru;
+    return lru;
+}
+static void ext2_iput(ext2_icache_t *ic) {
+    if(ic) ic->refs--;
+}
+
+// Indirect block, recently used ones stay referenced.
+static bcache_buf_t *ext2_ind_buf(drv_fs_ext2_data_t *data, uint32_t block) {
+    uint8_t n;
+    for(n = 0; n < EXT2_IND_CACHE; n++)
+        if(data->ind_block[n] == block && data->ind_buf[n]) break;
+    if(n == EXT2_IND_CACHE) {
+        bcache_buf_t *b = read_block(data, block);
+        if(b == 0) return 0;
+        n = data->ind_next;
+        data->ind_next = (uint8_t)((n + 1) % EXT2_IND_CACHE);
+        brelse(data->ind_buf[n]);
+        data->ind_buf[n] = b;
+        data->ind_block[n] = block;
+    }
+    return data->ind_buf[n];
+}
+// Entry index of indirect block, EXT2_MAP_ERROR when it can't be read.
+static uint32_t ext2_ind(drv_fs_ext2_data_t *data, uint32_t block,
+                         uint32_t index) {
+    if(block == 0 || block == EXT2_MAP_ERROR) return block;
+    bcache_buf_t *b = ext2_ind_buf(data, block);
+    return b ? ((uint32_t *)b->data)[index] : EXT2_MAP_ERROR;
+}
+static uint8_t ext2_ind_set(drv_fs_ext2_data_t *data, uint32_t block,
+                            uint32_t index, uint32_t value) {
+    bcache_buf_t *b = ext2_ind_buf(data, block);
+    if(b == 0) return 1;
+    ((uint32_t *)b->data)[index] = value;
+    bdirty(b);
+    return 0;
+}
+
+static uint8_t ext2_has_extents(drv_fs_ext2_data_t *data,
+                               const ext2_inode_t *inode) {
+    return (data->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_EXTENTS)
+           && (inode->i_flags & EXT4_EXTENTS_FL);
+}
+
+// Maps a file block through the extent tree rooted in i_block. len receives
+// how many blocks from lblock on are contiguous on disk, or stay a hole.
+// Unwritten extents and blocks above 32 bits read as holes.
+static uint32_t ext2_extent_map(drv_fs_ext2_data_t *data,
+                                const ext2_inode_t *inode, uint32_t lblock,
+                                uint32_t *len) {
+    const ext4_extent_header_t *eh = (const void *)inode->i_block;
+    uint32_t limit = 0xFFFFFFFF;  // Start of the next subtree.
+    *len = 1;
+    for(uint8_t level = 0; eh->eh_depth; level++) {
+        if(eh->eh_magic != EXT4_EXT_MAGIC || eh->eh_entries == 0 || level > 5)
+            return 0;
+        const ext4_extent_idx_t *idx = (const void *)(eh + 1);
+        uint32_t lo = 0, hi = eh->eh_entries;
+        while(hi - lo > 1) {
+            uint32_t mid = (lo + hi) / 2;
+            if(idx[mid].ei_block > lblock) hi = mid;
+            else
+                lo = mid;
+        }
+        if(hi < eh->eh_entries) limit = min(limit, idx[hi].ei_block);
+        if(lblock < idx[lo].ei_block) {
+            *len = idx[lo].ei_block - lblock;
+            return 0;
+        }
+        if(idx[lo].ei_leaf_hi) return 0;
+        bcache_buf_t *b = ext2_ind_buf(data, idx[lo].ei_leaf_lo);
+        if(b == 0) return EXT2_MAP_ERROR;
+        eh = (const void *)b->data;
+    }
+    if(eh->eh_magic != EXT4_EXT_MAGIC) return 0;
+    const ext4_extent_t *ex = (const void *)(eh + 1);
+    uint32_t lo = 0, hi = eh->eh_entries;
+    if(hi == 0 || lblock < ex[0].ee_block) {
+        *len = min(hi ? ex[0].ee_block : limit, limit) - lblock;
+        return 0;
+    }
+    while(hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if(ex[mid].ee_block > lblock) hi = mid;
+        else
+            lo = mid;
+    }
+    uint32_t elen = ex[lo].ee_len > EXT4_EXT_INIT_MAX_LEN
+                      ? ex[lo].ee_len - EXT4_EXT_INIT_MAX_LEN
+                      : ex[lo].ee_len;
+    if(lblock - ex[lo].ee_block >= elen) {
+        *len = (hi < eh->eh_entries ? min(ex[hi].ee_block, limit) : limit)
+               - lblock;
+        return 0;
+    }
+    *len = ex[lo].ee_block + elen - lblock;
+    if(ex[lo].ee_len > EXT4_EXT_INIT_MAX_LEN || ex[lo].ee_start_hi) return 0;
+    return ex[lo].ee_start_lo + (lblock - ex[lo].ee_block);
+}
+
+// Maps a file block to a disk block, 0 for holes and EXT2_MAP_ERROR when the
+// mapping can't be read.
+static uint32_t ext2_bmap(drv_fs_ext2_data_t *data, const ext2_inode_t *inode,
+                          uint32_t lblock) {
+    if(ext2_has_extents(data, inode)) {
+        uint32_t len;
+        return ext2_extent_map(data, inode, lblock, &len);
+    }
+    uint32_t ppb = data->block_size / 4;
+    if(lblock < 12) return inode->i_block[lblock];
+    lblock -= 12;
+    if(lblock < ppb) return ext2_ind(data, inode->i_block[12], lblock);
+    lblock -= ppb;
+    if(lblock < ppb * ppb)
+        return ext2_ind(data,
+                        ext2_ind(data, inode->i_block[13], lblock / ppb),
+                        lblock % ppb);
+    lblock -= ppb * ppb;
+    if(lblock / ppb / ppb >= ppb) return 0;
+    uint32_t ind = ext2_ind(data, inode->i_block[14], lblock / ppb / ppb);
+    ind = ext2_ind(data, ind, lblock / ppb % ppb);
+    return ext2_ind(data, ind, lblock % ppb);
+}
+
+// Next block for the inode near goal, taken from its preallocation when the
+// goal is the next reserved block. Fresh allocations reserve the blocks after
+// them so sequential writes stay contiguous.
+static uint32_t ext2_new_block(drv_fs_ext2_data_t *data, ext2_icache_t *ic,
+                               uint32_t goal) {
+    if(ic->prealloc_count && ic->prealloc == goal) {
+        ic->prealloc_count--;
+        return ic->prealloc++;
+    }
+    ext2_discard_prealloc(data, ic);
+    uint32_t block = ext2_alloc_block(data, goal);
+    if(block == 0) return 0;
+    uint32_t n = data->sb.s_prealloc_blocks ? data->sb.s_prealloc_blocks
+                                            : EXT2_PREALLOC;
+    if((ic->inode.i_mode & 0xF000) == 0x4000)
+        n = data->sb.s_prealloc_dir_blocks;
+    ic->prealloc = block + 1;
+    while(ic->prealloc_count < n
+          && ext2_take_block(data, ic->prealloc + ic->prealloc_count))
+        ic->prealloc_count++;
+    return block;
+}
+// Fills a block just taken for an indirect block or a directory with zeros.
+static uint8_t ext2_zero_block(drv_fs_ext2_data_t *data, uint32_t block) {
+    bcache_buf_t *b = read_block(data, block);
+    if(b == 0) return 1;
+    memset(b->data, 0, data->block_size);
+    bdirty(b);
+    brelse(b);
+    return 0;
+}
+
+// Like ext2_bmap, allocating the block and any missing indirect blocks on
+// the way. fresh is set when the data block is new.
+static uint32_t ext2_balloc(drv_fs_ext2_data_t *data, ext2_icache_t *ic,
+                            uint32_t lblock, uint8_t *fresh) {
+    ext2_inode_t *inode = &ic->inode;
+    uint32_t block = ext2_bmap(data, inode, lblock);
+    *fresh = 0;
+    if(block == EXT2_MAP_ERROR) return 0;
+    if(block) return block;
+    uint32_t ppb = data->block_size / 4, path[4], depth = 1, l = lblock;
+    if(l < 12) path[0] = l;
+    else if((l -= 12) < ppb) {
+        path[0] = 12;
+        path[1] = l;
+        depth = 2;
+    } else if((l -= ppb) < ppb * ppb) {
+        path[0] = 13;
+        path[1] = l / ppb;
+        path[2] = l % ppb;
+        depth = 3;
+    } else {
+        l -= ppb * ppb;
+        if(l / ppb / ppb >= ppb) return 0;
+        path[0] = 14;
+        path[1] = l / ppb / ppb;
+        path[2] = l / ppb % ppb;
+        path[3] = l % ppb;
+        depth = 4;
+    }
+    // Continue after the previous block of the file, or in the inode's group.
+    uint32_t goal = lblock ? ext2_bmap(data, inode, lblock - 1) : 0;
+    if(goal && goal != EXT2_MAP_ERROR) goal++;
+    else
+        goal = data->sb.s_first_data_block
+               + (ic->ino - 1) / data->sb.s_inodes_per_group
+                   * data->sb.s_blocks_per_group;
+    uint32_t parent = 0;
+    for(uint32_t d = 0; d < depth; d++) {
+        block = d ? ext2_ind(data, parent, path[d]) : inode->i_block[path[0]];
+        // Never allocate under an indirect block that can't be read.
+        if(block == EXT2_MAP_ERROR) return 0;
+        if(block == 0) {
+            block = ext2_new_block(data, ic, goal);
+            if(block == 0) return 0;
+            inode->i_blocks += data->block_size / 512;
+            if(d + 1 < depth && ext2_zero_block(data, block)) return 0;
+            if(d == 0) inode->i_block[path[0]] = block;
+            else if(ext2_ind_set(data, parent, path[d], block))
+                return 0;
+            if(d + 1 == depth) *fresh = 1;
+            goal = block + 1;
+        }
+        parent = block;
+    }
+    return block;
+}
+
+static uint32_t ext2_dir_blocks(drv_fs_ext2_data_t *data,
+                                const ext2_inode_t *inode) {
+    return (inode->i_size + data->block_size - 1) / data->block_size;
+}
+
+static void ext2_print_inode(drv_fs_ext2_data_t *data, uint32_t i,
+                             const char *path) {
+    ext2_icache_t *ic = ext2_iget(data, i);
+    if(ic == 0) return;
+    const ext2_inode_t *inode = &ic->inode;
+    if(inode->i_links_count == 0 || inode->i_links_count == 0xFFFF) {
+        ext2_iput(ic);
+        return;
+    }
+    // printf("inode %lu tp %04X links %u ", i, inode->i_mode,
+    // inode->i_links_count); printf("inode %lu tp %04X\n", i, inode->i_mode);
+    if((inode->i_mode & 0xF000) == 0x4000) {
         // printf("directory\n");
         // for(uint8_t j = 0; j < 15; j++) printf("found block %u %lu ", j,
-        // inode.i_block[j]);
-        for(uint8_t j = 0; j < 12; j++)
-            if(inode.i_block[j]) {
-                // printf("block %u %lu ", j, inode.i_block[j]);
+        // inode->i_block[j]);
+        for(uint32_t j = 0; j < ext2_dir_blocks(data, inode); j++) {
+            uint32_t blk = ext2_bmap(data, inode, j);
+            if(blk) {
+                // printf("block %u %lu ", j, blk);
                 uint32_t offset = 0;
                 while(offset < data->block_size) {
-                    read_block_buf(data, 1, inode.i_block[j]);
+                    if(read_block_buf(data, 1, blk)) break;
                     ext2_direntry_t *de = (void *)(data->buf[1] + offset);
                     if(de->size == 0) {
                         offset = (offset + 3) & ~3;
@@ -153,17 +785,20 @@ static void ext2_print_inode(drv_fs_ext2_data_t *data, uint32_t i,
                     }
                 }
             }
+        }
     }
+    ext2_iput(ic);
 }
 void ext2_print_inodes(drv_fs_ext2_data_t *data) {
     if(!data->ready) return;
     ext2_print_inode(data, 2, "");
 }
 
-static uint32_t find_in_dir_block(drv_fs_ext2_data_t *data, uint32_t block,
-                                  const char *name) {
+static uint8_t find_in_dir_block(drv_fs_ext2_data_t *data, uint32_t block,
+                                 const char *name, uint32_t len,
+                                 uint32_t *ino) {
     if(block == 0) return 0;
-    read_block_buf(data, 1, block);
+    if(read_block_buf(data, 1, block)) return 1;
     uint32_t offset = 0;
     while(offset < data->block_size) {
         ext2_direntry_t *de = (void *)(data->buf[1] + offset);
@@ -176,101 +811,687 @@ static uint32_t find_in_dir_block(drv_fs_ext2_data_t *data, uint32_t block,
             offset += de->size;
             continue;
         }
-        if(strncmp((char *)de->str, name, de->str_len) == 0) return de->inode;
+        if(de->str_len == len && memcmp(de->str, name, len) == 0) {
+            *ino = de->inode;
+            return 0;
+        }
         offset += de->size;
     }
     return 0;
 }
-static uint32_t ext2_find_in_dir(drv_fs_ext2_data_t *data, uint32_t dirinode,
-                                 const char *name) {
-    uint32_t group = (dirinode - 1) / data->sb.s_inodes_per_group,
-             index = ((dirinode - 1) % data->sb.s_inodes_per_group)
-                     * (data->sb.s_rev_level > 0 ? data->sb.s_inode_size : 128);
-    uint32_t group_blk = group / (data->block_size / sizeof(ext2_bgdt_t))
-                         + (data->block_size == 1024 ? 2 : 1);
-    read_block_bgdt(data, group_blk);
-    group %= (data->block_size / sizeof(ext2_bgdt_t));
-    uint32_t block
-      = index / data->block_size + data->bgdtbuf[group].bg_inode_table;
-    index = index % data->block_size;
-    read_block_buf(data, 0, block);
-    ext2_inode_t inode;
-    memcpy(&inode, data->buf[0] + index, sizeof(ext2_inode_t));
-    if(inode.i_links_count == 0 || inode.i_links_count == 0xFFFF
-       || (inode.i_mode & 0xF000) != 0x4000)
-        return 0;
-    for(uint8_t j = 0; j < 12; j++) {
-        if(inode.i_block[j] == 0) return 0;
-        uint32_t found = find_in_dir_block(data, inode.i_block[j], name);
-        if(found) return found;
-    }
-    if(inode.i_block[12]) {
-        read_block_buf(data, 0, inode.i_block[12]);
-        uint32_t *buf = (void *)data->buf[0];
-        for(uint32_t j = 0; j < data->block_size / 4; j++) {
-            if(buf[j] == 0) return 0;
-            uint32_t found = find_in_dir_block(data, buf[j], name);
-            if(found) return found;
-        }
-    } else
-        return 0;
-    return 0;
+// Last entry of an index block whose hash is not above the searched one.
+static uint32_t ext2_dx_search(const ext2_dx_entry_t *entries, uint32_t count,
+                               uint32_t hash) {
+    uint32_t lo = 1, hi = count;
+    while(lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if(entries[mid].hash > hash)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo - 1;
+}
+// HTree lookup, descends the index to the single leaf that can hold the name
+// and stores its directory block in leaf when given. Returns 2 when the index
+// looks damaged so the caller can scan linearly.
+static uint8_t ext2_dx_find(drv_fs_ext2_data_t *data, const ext2_inode_t *dir,
+                            const char *name, uint32_t len, uint32_t *ino,
+                            uint32_t *lblock) {
+    uint32_t block = ext2_bmap(data, dir, 0);
+    if(block == 0) return 2;
+    bcache_buf_t *b = read_block(data, block);
+    if(b == 0) return 1;
+    ext2_dx_root_info_t *info = (void *)(b->data + 24);  // After "." and "..".
+    uint8_t version = info->hash_version, levels = info->indirect_levels;
+    if(info->reserved_zero != 0 || info->info_length != 8 || levels > 1
+       || version > EXT2_HASH_TEA) {
+        brelse(b);
+        return 2;
+    }
+    if(data->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+        version += EXT2_HASH_LEGACY_UNSIGNED;
+    uint32_t hash = ext2_dirhash(data->sb.s_hash_seed, version, name, len);
+    ext2_dx_entry_t *entries = (void *)(b->data + 24 + 8);
+    uint32_t count, at, leaf;
+    while(1) {
+        ext2_dx_countlimit_t *cl = (void *)entries;
+        count = cl->count;
+        if(count == 0 || count > cl->limit
+           || (uint8_t *)(entries + cl->limit) > b->data + data->block_size) {
+            brelse(b);
+            return 2;
+        }
+        at = ext2_dx_search(entries, count, hash);
+        leaf = entries[at].block & 0x0FFFFFFF;
+        if(levels-- == 0) break;
+        brelse(b);
+        block = ext2_bmap(data, dir, leaf);
+        if(block == 0) return 2;
+        b = read_block(data, block);
+        if(b == 0) return 1;
+        entries = (void *)(b->data + 8);  // Behind an empty dirent.
+    }
+    if(lblock) *lblock = leaf;
+    uint8_t err = find_in_dir_block(data, ext2_bmap(data, dir, leaf), name, len,
+                                    ino);
+    // Names sharing a hash may continue in the following leaves, each marked
+    // with the low bit of its starting hash.
+    while(!err && !*ino && ++at < count && (entries[at].hash & 1)
+          && (entries[at].hash & ~1u) == hash)
+        err = find_in_dir_block(
+          data, ext2_bmap(data, dir, entries[at].block & 0x0FFFFFFF), name, len,
+          ino);
+    brelse(b);
+    return err;
+}
+
+// Sets ino to the entry or 0 when missing, fails if the directory is
+// unreadable.
+static uint8_t ext2_find_in_dir(drv_fs_ext2_data_t *data, uint32_t dirinode,
+                                const char *name, uint32_t len,
+                                uint32_t *ino) {
+    ext2_icache_t *ic = ext2_iget(data, dirinode);
+    uint8_t err = 0;
+    *ino = 0;
+    if(ic == 0) return 1;
+    if(ic->inode.i_links_count == 0 || ic->inode.i_links_count == 0xFFFF
+       || (ic->inode.i_mode & 0xF000) != 0x4000)
+        err = 1;
+    if(!err && (data->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)
+       && (ic->inode.i_flags & EXT2_INDEX_FL)) {
+        uint8_t r = ext2_dx_find(data, &ic->inode, name, len, ino, 0);
+        if(r != 2) {
+            ext2_iput(ic);
+            return r;
+        }
+    }
+    for(uint32_t j = 0; !err && !*ino && j < ext2_dir_blocks(data, &ic->inode);
+        j++)
+        err = find_in_dir_block(data, ext2_bmap(data, &ic->inode, j), name,
+                                len, ino);
+    ext2_iput(ic);
+    return err;
+}
+
+static uint32_t ext2_dhash(uint32_t parent, const char *name, uint32_t len) {
+    uint32_t h = 2166136261u ^ parent;  // FNV-1a
+    while(len--) h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h;
+}
+
+// (parent, name) -> inode, 0 cached for names known to be missing.
+static uint32_t ext2_lookup(drv_fs_ext2_data_t *data, uint32_t parent,
+                            const char *name, uint32_t len) {
+    uint32_t h = ext2_dhash(parent, name, len), ino;
+    ext2_dentry_t **bucket = &data->dhash[h % EXT2_DHASH], *d, *lru = 0;
+    for(d = *bucket; d; d = d->hnext)
+        if(d->hash == h && d->parent == parent && d->len == len
+           && memcmp(d->name, name, len) == 0) {
+            d->used = ++data->dclock;
+            return d->ino;
+        }
+    if(ext2_find_in_dir(data, parent, name, len, &ino)) return 0;
+    if(len > EXT2_DNAME) return ino;  // Too long to cache.
+    for(uint32_t n = 0; n < EXT2_DCACHE; n++) {
+        d = &data->dcache[n];
+        if(lru == 0 || d->used < lru->used) lru = d;
+    }
+    if(lru->parent) {
+        ext2_dentry_t **p = &data->dhash[lru->hash % EXT2_DHASH];
+        while(*p != lru) p = &(*p)->hnext;
+        *p = lru->hnext;
+    }
+    lru->parent = parent;
+    lru->ino = ino;
+    lru->hash = h;
+    lru->len = (uint8_t)len;
+    memcpy(lru->name, name, len);
+    lru->used = ++data->dclock;
+    lru->hnext = *bucket;
+    *bucket = lru;
+    return ino;
+}
+
+// Forgets a cached name after the directory changed.
+static void ext2_dcache_drop(drv_fs_ext2_data_t *data, uint32_t parent,
+                             const char *name, uint32_t len) {
+    uint32_t h = ext2_dhash(parent, name, len);
+    ext2_dentry_t **p = &data->dhash[h % EXT2_DHASH];
+    for(; *p; p = &(*p)->hnext) {
+        ext2_dentry_t *d = *p;
+        if(d->hash == h && d->parent == parent && d->len == len
+           && memcmp(d->name, name, len) == 0) {
+            *p = d->hnext;
+            d->parent = 0;
+            d->used = 0;
+            return;
+        }
+    }
+}
+
+// Resolves the components of path up to end.
+static uint32_t ext2_walk(drv_fs_ext2_data_t *data, uint32_t start,
+                          const char *path, const char *end) {
+    uint32_t ino = start;
+    while(path < end && ino) {
+        if(*path == '/') {
+            path++;
+            continue;
+        }
+        const char *next = path;
+        while(next < end && *next != '/') next++;
+        ino = ext2_lookup(data, ino, path, (uint32_t)(next - path));
+        path = next;
+    }
+    return ino;
 }
 uint32_t ext2_find_inode(drv_fs_ext2_data_t *data, uint32_t start,
                          const char *path) {
     if(!data->ready) return 0;
-    if(path[0] == '/') path++;
-    char *nextsep = memchr(path, '/', strlen(path));
-    if(nextsep == NULL) {
-        uint32_t inode = ext2_find_in_dir(data, start, path);
-        printf("found %s %lu\n", path, inode);
-        return inode;
-    } else {
-        uint32_t entrynamelen = nextsep - path;
-        char *entryname = malloc(entrynamelen + 1);
-        strncpy(entryname, path, entrynamelen);
-        entryname[entrynamelen] = 0;
-        uint32_t inode = ext2_find_in_dir(data, start, entryname);
-        printf("looking for %s %lu\n", entryname, inode);
-        free(entryname);
-        return ext2_find_inode(data, inode, nextsep + 1);
-    }
+    return ext2_walk(data, start, path, path + strlen(path));
+}
+// Directory of the last component of path, which name and len receive.
+static uint32_t ext2_parent(drv_fs_ext2_data_t *data, uint32_t start,
+                            const char *path, const char **name,
+                            uint32_t *len) {
+    const char *end = path + strlen(path);
+    while(end > path && end[-1] == '/') end--;
+    const char *last = end;
+    while(last > path && last[-1] != '/') last--;
+    *name = last;
+    *len = (uint32_t)(end - last);
+    return ext2_walk(data, start, path, last);
 }
 
 void ext2_dump_inode(drv_fs_ext2_data_t *data, uint32_t i) {
     if(!data->ready) return;
-    uint32_t group = (i - 1) / data->sb.s_inodes_per_group,
-             index = ((i - 1) % data->sb.s_inodes_per_group)
-                     * (data->sb.s_rev_level > 0 ? data->sb.s_inode_size : 128);
-    uint32_t group_blk = group / (data->block_size / sizeof(ext2_bgdt_t))
-                         + (data->block_size == 1024 ? 2 : 1);
-    read_block_bgdt(data, group_blk);
-    group %= (data->block_size / sizeof(ext2_bgdt_t));
-    uint32_t block
-      = index / data->block_size + data->bgdtbuf[group].bg_inode_table;
-    index = index % data->block_size;
-    read_block_buf(data, 0, block);
-    ext2_inode_t inode;
-    memcpy(&inode, data->buf[0] + index, sizeof(ext2_inode_t));
-    if(inode.i_links_count == 0 || inode.i_links_count == 0xFFFF) {
+    ext2_icache_t *ic = ext2_iget(data, i);
+    if(ic == 0 || ic->inode.i_links_count == 0
+       || ic->inode.i_links_count == 0xFFFF) {
         printf("inode %lu unused\n", i);
+        ext2_iput(ic);
         return;
     }
+    const ext2_inode_t *inode = &ic->inode;
     printf("inode %lu\n", i);
-    printf("mode %04X\n", inode.i_mode);
-    printf("size %lu\n", inode.i_size);
-    printf("uid %u\n", inode.i_uid);
-    printf("gid %u\n", inode.i_gid);
-    printf("links %u\n", inode.i_links_count);
-    printf("blocks %lu\n", inode.i_blocks);
-    printf("flags %08lX\n", inode.i_flags);
+    printf("mode %04X\n", inode->i_mode);
+    printf("size %lu\n", inode->i_size);
+    printf("uid %u\n", inode->i_uid);
+    printf("gid %u\n", inode->i_gid);
+    printf("links %u\n", inode->i_links_count);
+    printf("blocks %lu\n", inode->i_blocks);
+    printf("flags %08lX\n", inode->i_flags);
     for(uint8_t j = 0; j < 15; j++)
-        printf("block%u %lu\n", j, inode.i_block[j]);
+        printf("block%u %lu\n", j, inode->i_block[j]);
+    ext2_iput(ic);
+}
+
+// Reads len bytes at offset, runs of contiguous blocks in one transfer.
+uint32_t ext2_read(drv_fs_ext2_data_t *data, uint32_t i, uint32_t offset,
+                   uint8_t *buf, uint32_t len) {
+    if(!data->ready) return 0;
+    ext2_icache_t *ic = ext2_iget(data, i);
+    if(ic == 0) return 0;
+    const ext2_inode_t *inode = &ic->inode;
+    if(offset >= inode->i_size) len = 0;
+    else if(len > inode->i_size - offset)
+        len = inode->i_size - offset;
+    uint32_t bs = data->block_size, done = 0;
+    while(done < len) {
+        uint32_t pos = offset + done, in = pos % bs, lblock = pos / bs;
+        uint32_t run = 1, max = in == 0 ? (len - done) / bs : 0, block;
+        // One extent lookup yields the whole run, block maps go block by
+        // block.
+        if(ext2_has_extents(data, inode)) {
+            block = ext2_extent_map(data, inode, lblock, &run);
+            run = min(run, max);
+        } else {
+            block = ext2_bmap(data, inode, lblock);
+            while(block != EXT2_MAP_ERROR && run < max
+                  && ext2_bmap(data, inode, lblock + run)
+                       == (block ? block + run : 0))
+                run++;
+        }
+        if(block == EXT2_MAP_ERROR) break;
+        if(max) {
+            if(block == 0) memset(buf + done, 0, run * bs);  // Hole.
+            else if(bcache_read(data->dev,
+                                data->fs_start + block * (bs / 512),
+                                run * (bs / 512), buf + done))
+                break;
+            done += run * bs;
+            continue;
+        }
+        uint32_t n = min(bs - in, len - done);
+        if(block == 0) memset(buf + done, 0, n);
+        else {
+            bcache_buf_t *b = read_block(data, block);
+            if(b == 0) break;
+            memcpy(buf + done, b->data + in, n);
+            brelse(b);
+        }
+        done += n;
+    }
+    ext2_iput(ic);
+    return done;
+}
+
+#define EXT2_DIRENT_LEN(len) (((len) + 8 + 3) & ~3u)
+
+// Puts an entry into a directory block. Returns 2 when it has no room.
+static uint8_t ext2_dir_insert(drv_fs_ext2_data_t *data, uint32_t block,
+                               const char *name, uint32_t len, uint32_t ino,
+                               uint8_t type) {
+    bcache_buf_t *b = read_block(data, block);
+    if(b == 0) return 1;
+    uint32_t need = EXT2_DIRENT_LEN(len), offset = 0;
+    while(offset + 8 <= data->block_size) {
+        ext2_direntry_t *de = (void *)(b->data + offset);
+        if(de->size < 8 || offset + de->size > data->block_size) break;
+        uint32_t used = de->inode ? EXT2_DIRENT_LEN(de->str_len) : 0;
+        if(de->size - used >= need) {
+            // Split the slack off the end of a live entry.
+            if(used) {
+                ext2_direntry_t *n = (void *)(b->data + offset + used);
+                n->size = (uint16_t)(de->size - used);
+                de->size = (uint16_t)used;
+                de = n;
+            }
+            de->inode = ino;
+            de->str_len = (uint8_t)len;
+            de->type = type;
+            memcpy(de->str, name, len);
+            bdirty(b);
+            brelse(b);
+            return 0;
+        }
+        offset += de->size;
+    }
+    brelse(b);
+    return 2;
+}
+// Removes name from a directory block by merging it into the previous
+// entry. Returns 2 when it is not there.
+static uint8_t ext2_dir_remove(drv_fs_ext2_data_t *data, uint32_t block,
+                               const char *name, uint32_t len) {
+    bcache_buf_t *b = read_block(data, block);
+    if(b == 0) return 1;
+    ext2_direntry_t *prev = 0;
+    uint32_t offset = 0;
+    while(offset + 8 <= data->block_size) {
+        ext2_direntry_t *de = (void *)(b->data + offset);
+        if(de->size < 8 || offset + de->size > data->block_size) break;
+        if(de->inode && de->str_len == len && memcmp(de->str, name, len) == 0) {
+            if(prev) prev->size = (uint16_t)(prev->size + de->size);
+            else
+                de->inode = 0;
+            bdirty(b);
+            brelse(b);
+            return 0;
+        }
+        prev = de;
+        offset += de->size;
+    }
+    brelse(b);
+    return 2;
+}
+
+static uint8_t ext2_dx_usable(drv_fs_ext2_data_t *data,
+                              const ext2_inode_t *dir) {
+    return (data->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)
+           && (dir->i_flags & EXT2_INDEX_FL);
+}
+
+// Links name to ino in dir, growing the directory when all blocks are full.
+static uint8_t ext2_add_entry(drv_fs_ext2_data_t *data, ext2_icache_t *dir,
+                              const char *name, uint32_t len, uint32_t ino,
+                              uint8_t type) {
+    uint32_t found, leaf, block;
+    uint8_t fresh, err;
+    if(ext2_dx_usable(data, &dir->inode)) {
+        // The hashed leaf keeps the index valid, a full one would need a
+        // split, so the directory goes back to linear until fsck -D.
+        if(ext2_dx_find(data, &dir->inode, name, len, &found, &leaf) == 0
+           && (block = ext2_bmap(data, &dir->inode, leaf)) != 0
+           && ext2_dir_insert(data, block, name, len, ino, type) == 0)
+            return 0;
+        dir->inode.i_flags &= ~EXT2_INDEX_FL;
+    }
+    uint32_t blocks = ext2_dir_blocks(data, &dir->inode);
+    for(uint32_t j = 0; j < blocks; j++) {
+        block = ext2_bmap(data, &dir->inode, j);
+        if(block == 0) continue;
+        err = ext2_dir_insert(data, block, name, len, ino, type);
+        if(err != 2) return err;
+    }
+    block = ext2_balloc(data, dir, blocks, &fresh);
+    if(block == 0) return 1;
+    bcache_buf_t *b = read_block(data, block);
+    if(b == 0) return 1;
+    memset(b->data, 0, data->block_size);
+    ((ext2_direntry_t *)b->data)->size = (uint16_t)data->block_size;
+    bdirty(b);
+    brelse(b);
+    dir->inode.i_size = (blocks + 1) * data->block_size;
+    return ext2_dir_insert(data, block, name, len, ino, type);
+}
+
+// Frees the blocks for file blocks from onwards below an indirect block of
+// the given depth covering file blocks from base. Returns 1 when the
+// indirect block itself was freed, 2 when it is kept because it or one below
+// it can't be read, their blocks then stay allocated.
+static uint8_t ext2_trunc_ind(drv_fs_ext2_data_t *data, uint32_t ind,
+                              uint8_t depth, uint32_t base, uint32_t from,
+                              uint32_t *freed) {
+    uint32_t ppb = data->block_size / 4, span = 1;
+    for(uint8_t d = 1; d < depth; d++) span *= ppb;
+    if(ext2_ind_buf(data, ind) == 0) return 2;
+    uint8_t keep = 0, r = 1;
+    for(uint32_t e = 0; e < ppb; e++) {
+        uint32_t child = ext2_ind(data, ind, e), cbase = base + e * span;
+        if(child == 0) continue;
+        if(child == EXT2_MAP_ERROR) return 2;
+        if(cbase + span <= from) keep = 1;
+        else if(depth == 1
+                || (r = ext2_trunc_ind(data, child, depth - 1, cbase, from,
+                                       freed))
+                     == 1) {
+            if(depth == 1) {
+                ext2_free_block(data, child);
+                (*freed)++;
+            }
+            ext2_ind_set(data, ind, e, 0);
+        } else if(r == 2)
+            return 2;
+        else
+            keep = 1;
+    }
+    if(keep) return 0;
+    ext2_free_block(data, ind);
+    (*freed)++;
+    return 1;
+}
+// Fails when part of the block map can't be read, the size then stays.
+static uint8_t ext2_trunc(drv_fs_ext2_data_t *data, ext2_icache_t *ic,
+                          uint32_t size) {
+    ext2_inode_t *inode = &ic->inode;
+    uint32_t bs = data->block_size, ppb = bs / 4, freed = 0;
+    uint8_t err = 0;
+    ext2_discard_prealloc(data, ic);
+    if(size < inode->i_size) {
+        // Zero the tail of the last kept block for a later extension.
+        uint32_t block = size % bs ? ext2_bmap(data, inode, size / bs) : 0;
+        bcache_buf_t *b = block ? read_block(data, block) : 0;
+        if(block && b == 0) return 1;
+        if(b) {
+            memset(b->data + size % bs, 0, bs - size % bs);
+            bdirty(b);
+            brelse(b);
+        }
+        uint32_t from = (size + bs - 1) / bs, base = 12, span = 1;
+        for(uint32_t j = from; j < 12; j++)
+            if(inode->i_block[j]) {
+                ext2_free_block(data, inode->i_block[j]);
+                inode->i_block[j] = 0;
+                freed++;
+            }
+        for(uint8_t d = 1; d <= 3; d++) {
+            span *= ppb;
+            uint32_t *top = &inode->i_block[11 + d];
+            if(*top && base + span > from) {
+                uint8_t r = ext2_trunc_ind(data, *top, d, base, from, &freed);
+                if(r == 1) *top = 0;
+                else if(r == 2)
+                    err = 1;
+            }
+            base += span;
+        }
+        inode->i_blocks -= freed * (bs / 512);
+    }
+    if(err == 0) inode->i_size = size;
+    return err;
+}
+
+// Creates an empty regular file, an existing entry is returned as it is.
+uint32_t ext2_create(drv_fs_ext2_data_t *data, uint32_t start, const char *path,
+                     uint16_t mode) {
+    if(!data->ready || !data->writable) return 0;
+    const char *name;
+    uint32_t len, dir = ext2_parent(data, start, path, &name, &len);
+    if(dir == 0 || len == 0 || len > 255) return 0;
+    uint32_t ino = ext2_lookup(data, dir, name, len);
+    if(ino) return ino;
+    ext2_icache_t *dc = ext2_iget(data, dir);
+    if(dc == 0 || (dc->inode.i_mode & 0xF000) != 0x4000
+       || (ino = ext2_alloc_inode(data, dir)) == 0) {
+        ext2_iput(dc);
+        return 0;
+    }
+    // Clear the whole on-disk slot, including any extra inode fields.
+    uint32_t off;
+    bcache_buf_t *b = ext2_inode_slot(data, ino, &off);
+    ext2_icache_t *ic = ext2_iget(data, ino);
+    if(b == 0 || ic == 0) {
+        brelse(b);
+        ext2_iput(ic);
+        ext2_free_inode(data, ino);
+        ext2_iput(dc);
+        return 0;
+    }
+    memset(b->data + off, 0,
+           data->sb.s_rev_level > 0 ? data->sb.s_inode_size : 128);
+    bdirty(b);
+    brelse(b);
+    memset(&ic->inode, 0, sizeof(ext2_inode_t));
+    ic->inode.i_mode = (uint16_t)(0x8000 | (mode & 0xFFF));
+    ic->inode.i_links_count = 1;
+    ext2_write_inode(data, ino, &ic->inode);
+    uint8_t type
+      = (data->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) ? 1 : 0;
+    if(ext2_add_entry(data, dc, name, len, ino, type)) {
+        ic->inode.i_links_count = 0;
+        ic->inode.i_dtime = 1;
+        ext2_write_inode(data, ino, &ic->inode);
+        ext2_free_inode(data, ino);
+        ino = 0;
+    }
+    ext2_write_inode(data, dir, &dc->inode);
+    ext2_dcache_drop(data, dir, name, len);
+    ext2_iput(ic);
+    ext2_iput(dc);
+    return ino;
+}
+
+// Writes len bytes at offset, runs of whole blocks in one transfer.
+uint32_t ext2_write(drv_fs_ext2_data_t *data, uint32_t i, uint32_t offset,
+                    const uint8_t *buf, uint32_t len) {
+    if(!data->ready || !data->writable) return 0;
+    ext2_icache_t *ic = ext2_iget(data, i);
+    if(ic == 0) return 0;
+    if((ic->inode.i_mode & 0xF000) != 0x8000) {
+        ext2_iput(ic);
+        return 0;
+    }
+    uint32_t bs = data->block_size, done = 0;
+    uint8_t fresh;
+    while(done < len) {
+        uint32_t pos = offset + done, in = pos % bs, lblock = pos / bs;
+        uint32_t block = ext2_balloc(data, ic, lblock, &fresh);
+        if(block == 0) break;
+        if(in == 0 && len - done >= bs) {
+            uint32_t run = 1, max = (len - done) / bs;
+            while(run < max
+                  && ext2_balloc(data, ic, lblock + run, &fresh) == block + run)
+                run++;
+            if(bcache_write(data->dev, data->fs_start + block * (bs / 512),
+                            run * (bs / 512), buf + done))
+                break;
+            done += run * bs;
+            continue;
+        }
+        uint32_t n = min(bs - in, len - done);
+        bcache_buf_t *b = read_block(data, block);
+        if(b == 0) break;
+        if(fresh) memset(b->data, 0, bs);
+        memcpy(b->data + in, buf + done, n);
+        bdirty(b);
+        brelse(b);
+        done += n;
+    }
+    if(offset + done > ic->inode.i_size) ic->inode.i_size = offset + done;
+    ext2_write_inode(data, i, &ic->inode);
+    ext2_iput(ic);
+    return done;
+}
+
+uint8_t ext2_truncate(drv_fs_ext2_data_t *data, uint32_t i, uint32_t size) {
+    if(!data->ready || !data->writable) return 1;
+    ext2_icache_t *ic = ext2_iget(data, i);
+    if(ic == 0) return 1;
+    uint8_t err = 1;
+    if((ic->inode.i_mode & 0xF000) == 0x8000) {
+        err = ext2_trunc(data, ic, size);
+        if(ext2_write_inode(data, i, &ic->inode)) err = 1;
+    }
+    ext2_iput(ic);
+    return err;
+}
+
+// Removes a file name, and the file with its last link.
+uint8_t ext2_unlink(drv_fs_ext2_data_t *data, uint32_t start,
+                    const char *path) {
+    if(!data->ready || !data->writable) return 1;
+    const char *name;
+    uint32_t len, dir = ext2_parent(data, start, path, &name, &len);
+    if(dir == 0 || len == 0) return 1;
+    uint32_t ino = ext2_lookup(data, dir, name, len), leaf;
+    ext2_icache_t *dc = ext2_iget(data, dir), *ic = ext2_iget(data, ino);
+    uint8_t err = 1;
+    if(dc && ic && (ic->inode.i_mode & 0xF000) != 0x4000) {
+        err = 2;
+        uint32_t found;
+        if(ext2_dx_usable(data, &dc->inode)
+           && ext2_dx_find(data, &dc->inode, name, len, &found, &leaf) == 0
+           && found == ino)
+            err = ext2_dir_remove(data, ext2_bmap(data, &dc->inode, leaf), name,
+                                  len);
+        // Not in the hashed leaf, e.g. past a collision.
+        for(uint32_t j = 0; err == 2 && j < ext2_dir_blocks(data, &dc->inode);
+            j++) {
+            uint32_t block = ext2_bmap(data, &dc->inode, j);
+            if(block) err = ext2_dir_remove(data, block, name, len);
+        }
+    }
+    if(err == 0) {
+        ext2_dcache_drop(data, dir, name, len);
+        if(--ic->inode.i_links_count == 0) {
+            // Blocks under an unreadable block map stay allocated for fsck.
+            ext2_trunc(data, ic, 0);
+            ic->inode.i_dtime = data->sb.s_wtime ? data->sb.s_wtime : 1;
+            ext2_free_inode(data, ino);
+        }
+        err = ext2_write_inode(data, ino, &ic->inode);
+    }
+    ext2_iput(ic);
+    ext2_iput(dc);
+    return err ? 1 : 0;
+}
+
+// Releases preallocations and writes the superblock and all dirty blocks.
+uint8_t ext2_sync(drv_fs_ext2_data_t *data) {
+    if(!data->ready || !data->writable) return 0;
+    for(uint32_t n = 0; n < EXT2_ICACHE; n++)
+        ext2_discard_prealloc(data, &data->icache[n]);
+    if(data->sb_dirty) {
+        if(bcache_write(data->dev, data->fs_start + 2, 2, (void *)&data->sb))
+            return 1;
+        data->sb_dirty = 0;
+    }
+    if(bcache_sync(data->dev)) return 1;
+    ext2_trim_flush(data);
+    return 0;
+}
+
+// Totals are summed from the group descriptors, only groups that had blocks
+// freed since their last scan read their bitmap.
+void ext2_statfs(drv_fs_ext2_data_t *data, vfs_statfs_t *st) {
+    memset(st, 0, sizeof(vfs_statfs_t));
+    if(!data->ready) return;
+    st->block_size = data->block_size;
+    st->blocks = data->sb.s_blocks_count;
+    st->files = data->sb.s_inodes_count;
+    for(uint32_t g = 0; g < data->num_bgds; g++) {
+        st->free_blocks += data->bgdt[g].bg_free_blocks_count;
+        st->free_files += data->bgdt[g].bg_free_inodes_count;
+        if(!data->writable) continue;
+        if(data->max_run[g] == EXT2_RUN_STALE && ext2_scan_group(data, g))
+            continue;
+        if(data->max_run[g] > st->max_free_run)
+            st->max_free_run = data->max_run[g];
+    }
+    if(st->free_blocks > data->sb.s_r_blocks_count)
+        st->avail_blocks = st->free_blocks - data->sb.s_r_blocks_count;
+}
+
+// Handles are inode numbers.
+static uint32_t ext2_open(drv_fs_t *drv, const char *path, uint32_t flags) {
+    drv_fs_ext2_data_t *data = drv->drv_data;
+    uint8_t modify = (flags & (VFS_O_WRITE | VFS_O_CREATE | VFS_O_TRUNC)) != 0;
+    if(modify && !data->writable) return 0;
+    uint32_t ino = (flags & VFS_O_CREATE) ? ext2_create(data, 2, path, 0644)
+                                          : ext2_find_inode(data, 2, path);
+    ext2_icache_t *ic = ext2_iget(data, ino);
+    if(ic == 0) return 0;
+    // Only regular files can be written.
+    if(modify && (ic->inode.i_mode & 0xF000) != 0x8000) ino = 0;
+    ext2_iput(ic);
+    if(ino && (flags & VFS_O_TRUNC) && ext2_truncate(data, ino, 0)) return 0;
+    return ino;
+}
+static uint32_t ext2_fs_read(drv_fs_t *drv, uint32_t file, uint32_t offset,
+                             uint8_t *ptr, uint32_t len) {
+    return ext2_read(drv->drv_data, file, offset, ptr, len);
+}
+static uint32_t ext2_fstat(drv_fs_t *drv, uint32_t file, uint32_t *mode,
+                           uint32_t *size) {
+    ext2_icache_t *ic = ext2_iget(drv->drv_data, file);
+    if(ic == 0) return 1;
+    *mode = ic->inode.i_mode;
+    *size = ic->inode.i_size;
+    ext2_iput(ic);
+    return 0;
+}
+static uint32_t ext2_fs_write(drv_fs_t *drv, uint32_t file, uint32_t offset,
+                              const uint8_t *ptr, uint32_t len) {
+    return ext2_write(drv->drv_data, file, offset, ptr, len);
+}
+static uint32_t ext2_resize(drv_fs_t *drv, uint32_t file, uint32_t size) {
+    return ext2_truncate(drv->drv_data, file, size);
+}
+static uint32_t ext2_close(drv_fs_t *drv, uint32_t file) {
+    ext2_icache_t *ic = ext2_iget(drv->drv_data, file);
+    if(ic == 0) return 0;
+    ext2_discard_prealloc(drv->drv_data, ic);
+    ext2_iput(ic);
+    return 0;
+}
+static uint32_t ext2_fs_unlink(drv_fs_t *drv, const char *path) {
+    return ext2_unlink(drv->drv_data, 2, path);
+}
+static uint32_t ext2_fs_statfs(drv_fs_t *drv, vfs_statfs_t *st) {
+    ext2_statfs(drv->drv_data, st);
+    return 0;
 }
 
-// static uint32_t ext2_open(drv_fs_t *drv, const char *path) {
-//     return ext2_find_inode(drv->drv_data, 2, path);
-// }
-// static uint32_t ext2_close(drv_fs_t *drv, uint32_t file) {
-//     return 0;
-// }
\ No newline at end of file
+void drv_fs_ext2_init(drv_fs_t *drv) {
+    drv->open = ext2_open;
+    drv->resize = ext2_resize;
+    drv->read = ext2_fs_read;
+    drv->write = ext2_fs_write;
+    drv->fstat = ext2_fstat;
+    drv->close = ext2_close;
+    drv->unlink = ext2_fs_unlink;
+    drv->statfs = ext2_fs_statfs;
+    drv->reserve = 0;
+}
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include "ext2.h"
+
+#include <stdint.h>
+
+// Directory index hashes, bit-compatible with the ones e2fsprogs writes.
+
+static uint32_t rol32(uint32_t x, uint8_t s) {
+    return (x << s) | (x >> (32 - s));
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rol32(a, s))
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+static void half_md4(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+    ROUND(F, a, b, c, d, in[0], 3);
+    ROUND(F, d, a, b, c, in[1], 7);
+    ROUND(F, c, d, a, b, in[2], 11);
+    ROUND(F, b, c, d, a, in[3], 19);
+    ROUND(F, a, b, c, d, in[4], 3);
+    ROUND(F, d, a, b, c, in[5], 7);
+    ROUND(F, c, d, a, b, in[6], 11);
+    ROUND(F, b, c, d, a, in[7], 19);
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static void tea(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+    for(uint8_t n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// The signed variants sign-extend each byte like the original x86 code did.
+static int32_t hash_char(const char *name, uint32_t i, uint8_t is_unsigned) {
+    return is_unsigned ? (int32_t)(uint8_t)name[i]
+                       : (int32_t)(int8_t)name[i];
+}
+
+static uint32_t legacy(const char *name, uint32_t len, uint8_t is_unsigned) {
+    uint32_t hash, hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+    for(uint32_t i = 0; i < len; i++) {
+        hash = hash1
+               + (hash0 ^ (uint32_t)(hash_char(name, i, is_unsigned) * 7152373));
+        if(hash & 0x80000000) hash -= 0x7FFFFFFF;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// Packs up to num words of the name, padded with the length.
+static void str2hashbuf(const char *name, uint32_t len, uint32_t *buf,
+                        int8_t num, uint8_t is_unsigned) {
+    uint32_t pad = len | (len << 8), val;
+    pad |= pad << 16;
+    val = pad;
+    if(len > (uint32_t)num * 4) len = num * 4;
+    for(uint32_t i = 0; i < len; i++) {
+        val = (uint32_t)hash_char(name, i, is_unsigned) + (val << 8);
+        if(i % 4 == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if(--num >= 0) *buf++ = val;
+    while(--num >= 0) *buf++ = pad;
+}
+
+uint32_t ext2_dirhash(const uint32_t seed[4], uint8_t version,
+                      const char *name, uint32_t len) {
+    uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+    uint32_t in[8], hash;
+    uint8_t is_unsigned = version >= EXT2_HASH_LEGACY_UNSIGNED;
+    // An all-zero seed means the default one.
+    if(seed[0] | seed[1] | seed[2] | seed[3])
+        for(uint8_t i = 0; i < 4; i++) buf[i] = seed[i];
+    switch(version) {
+    case EXT2_HASH_LEGACY:
+    case EXT2_HASH_LEGACY_UNSIGNED:
+        hash = legacy(name, len, is_unsigned);
+        break;
+    case EXT2_HASH_HALF_MD4:
+    case EXT2_HASH_HALF_MD4_UNSIGNED:
+        for(int32_t left = len; left > 0; left -= 32, name += 32) {
+            str2hashbuf(name, left, in, 8, is_unsigned);
+            half_md4(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case EXT2_HASH_TEA:
+    case EXT2_HASH_TEA_UNSIGNED:
+        for(int32_t left = len; left > 0; left -= 16, name += 16) {
+            str2hashbuf(name, left, in, 4, is_unsigned);
+            tea(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        return 0;
+    }
+    // The lowest bit marks hash collisions in the index.
+    hash &= ~1u;
+    if(hash == 0x7FFFFFFFu << 1) hash = 0x7FFFFFFEu << 1;
+    return hash;
+}
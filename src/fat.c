@@ -0,0 +1,218 @@
+#include "drivers.h"
+#include "fatfs/diskio.h"
+#include "fatfs/ff.h"
+#include "mutex.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// drv_fs_t adapter for FatFs, handles are malloc'd FIL objects.
+
+// Volume prefix followed by the absolute path, freed by the caller.
+static char *fat_path(drv_fs_t *drv, const char *path) {
+    const char *volume = drv->drv_data;
+    char *full = malloc(strlen(volume) + strlen(path) + 2);
+    if(full == 0) return 0;
+    strcpy(full, volume);
+    if(*path != '/') strcat(full, "/");
+    strcat(full, path);
+    return full;
+}
+
+static uint32_t fat_open(drv_fs_t *drv, const char *path, uint32_t flags) {
+    BYTE mode = 0;
+    if(flags & VFS_O_READ) mode |= FA_READ;
+    if(flags & VFS_O_WRITE) mode |= FA_WRITE;
+    if(flags & VFS_O_CREATE)
+        mode |= (flags & VFS_O_TRUNC) ? FA_CREATE_ALWAYS : FA_OPEN_ALWAYS;
+    FIL *fp = malloc(sizeof(FIL));
+    char *full = fat_path(drv, path);
+    FRESULT res = FR_NOT_ENOUGH_CORE;
+    if(fp && full) res = f_open(fp, full, mode);
+    // O_TRUNC without O_CREAT must not create the file.
+    if(res == FR_OK && (flags & VFS_O_TRUNC) && !(flags & VFS_O_CREATE)) {
+        res = f_truncate(fp);
+        if(res != FR_OK) f_close(fp);
+    }
+    free(full);
+    if(res != FR_OK) {
+        free(fp);
+        return 0;
+    }
+    return (uint32_t)fp;
+}
+
+#define FAT_CLMT_INIT 16  // DWORDs, enough for 7 fragments.
+
+// Fast seek: the cluster link map of a file is built on its first seek, then
+// seeks and reads find clusters without walking the FAT chain. FatFs cannot
+// grow a file through the map, so it goes before anything that resizes it.
+static void fat_clmt_drop(FIL *fp) {
+    free(fp->cltbl);
+    fp->cltbl = 0;
+}
+static void fat_clmt_build(FIL *fp) {
+    DWORD size = FAT_CLMT_INIT;
+    while(1) {
+        fp->cltbl = malloc(size * sizeof(DWORD));
+        if(fp->cltbl == 0) return;
+        fp->cltbl[0] = size;
+        FRESULT res = f_lseek(fp, CREATE_LINKMAP);
+        if(res == FR_OK) return;
+        // On FR_NOT_ENOUGH_CORE the first entry holds the needed size.
+        size = fp->cltbl[0];
+        fat_clmt_drop(fp);
+        if(res != FR_NOT_ENOUGH_CORE) return;
+    }
+}
+
+// Moves to offset for an access ending at end.
+static uint8_t fat_seek(FIL *fp, uint32_t offset, uint32_t end) {
+    if(fp->cltbl && end > f_size(fp)) fat_clmt_drop(fp);
+    if(f_tell(fp) == offset) return 0;
+    if(fp->cltbl == 0 && end <= f_size(fp)) fat_clmt_build(fp);
+    return f_lseek(fp, offset) != FR_OK || f_tell(fp) != offset;
+}
+
+static uint32_t fat_read(drv_fs_t *drv, uint32_t file, uint32_t offset,
+                         uint8_t *ptr, uint32_t len) {
+    (void)drv;
+    FIL *fp = (FIL *)file;
+    UINT n = 0;
+    if(f_tell(fp) != offset && offset >= f_size(fp)) return 0;
+    if(fat_seek(fp, offset, offset)) return 0;
+    if(f_read(fp, ptr, len, &n) != FR_OK) return 0;
+    return n;
+}
+// First cluster of a file stored as a single run, 0 if it is fragmented or
+// that is not known.
+static DWORD fat_run_start(FIL *fp) {
+    if(fp->obj.fs->fs_type == FS_EXFAT && fp->obj.stat == 2)
+        return fp->obj.sclust;
+    if(fp->cltbl && fp->cltbl[1] && fp->cltbl[3] == 0) return fp->cltbl[2];
+    return 0;
+}
+
+// Writes count whole sectors at the file pointer of a single run file with
+// one disk command, where f_write would split them at every cluster.
+static uint8_t fat_write_sectors(FIL *fp, const uint8_t *ptr, uint32_t count) {
+    FATFS *fs = fp->obj.fs;
+    LBA_t sect = fs->database + (LBA_t)(fat_run_start(fp) - 2) * fs->csize
+                 + f_tell(fp) / FF_MAX_SS;
+    if(disk_write(fs->pdrv, ptr, sect, count) != RES_OK) return 1;
+    // A buffered copy may be flushed later, it has to match.
+    if(fp->sect - sect < count)
+        memcpy(fp->buf, ptr + (fp->sect - sect) * FF_MAX_SS, FF_MAX_SS);
+    return f_lseek(fp, f_tell(fp) + count * FF_MAX_SS) != FR_OK;
+}
+
+static uint32_t fat_write(drv_fs_t *drv, uint32_t file, uint32_t offset,
+                          const uint8_t *ptr, uint32_t len) {
+    (void)drv;
+    FIL *fp = (FIL *)file;
+    UINT n = 0, done = 0;
+    // Seeking past the end grows the file, like a sparse write.
+    if(fat_seek(fp, offset, offset + len)) return 0;
+    if(len >= FF_MAX_SS && offset + len <= f_size(fp) && fat_run_start(fp)) {
+        UINT head = (FF_MAX_SS - offset % FF_MAX_SS) % FF_MAX_SS;
+        if(f_write(fp, ptr, head, &n) != FR_OK || n != head) return n;
+        uint32_t count = (len - head) / FF_MAX_SS;
+        if(count && fat_write_sectors(fp, ptr + head, count)) return head;
+        done = head + count * FF_MAX_SS;
+    }
+    // Also marks the file modified after a direct write.
+    if(f_write(fp, ptr + done, len - done, &n) != FR_OK) return done;
+    return done + n;
+}
+static uint32_t fat_fstat(drv_fs_t *drv, uint32_t file, uint32_t *mode,
+                          uint32_t *size) {
+    (void)drv;
+    FIL *fp = (FIL *)file;
+    *mode = 0x8000 | ((fp->obj.attr & AM_RDO) ? 0444 : 0644);
+    *size = (uint32_t)f_size(fp);
+    return 0;
+}
+static uint32_t fat_resize(drv_fs_t *drv, uint32_t file, uint32_t size) {
+    (void)drv;
+    FIL *fp = (FIL *)file;
+    fat_clmt_drop(fp);
+    if(f_lseek(fp, size) != FR_OK) return 1;
+    return size < f_size(fp) ? f_truncate(fp) : 0;
+}
+// f_expand leaves one run of clusters, so the link map is known without
+// walking the chain and later writes take the direct path.
+static uint32_t fat_reserve(drv_fs_t *drv, uint32_t file, uint32_t size) {
+    (void)drv;
+    FIL *fp = (FIL *)file;
+    if(f_expand(fp, size, 1) != FR_OK) return 1;
+    fat_clmt_drop(fp);
+    fp->cltbl = malloc(FAT_CLMT_INIT * sizeof(DWORD));
+    if(fp->cltbl) {
+        DWORD cluster = fp->obj.fs->csize * FF_MAX_SS;
+        fp->cltbl[0] = 4;
+        fp->cltbl[1] = (size + cluster - 1) / cluster;
+        fp->cltbl[2] = fp->obj.sclust;
+        fp->cltbl[3] = 0;
+    }
+    return 0;
+}
+
+static uint32_t fat_close(drv_fs_t *drv, uint32_t file) {
+    (void)drv;
+    FRESULT res = f_close((FIL *)file);
+    fat_clmt_drop((FIL *)file);
+    free((FIL *)file);
+    return res;
+}
+static uint32_t fat_unlink(drv_fs_t *drv, const char *path) {
+    char *full = fat_path(drv, path);
+    if(full == 0) return 1;
+    FRESULT res = f_unlink(full);
+    free(full);
+    return res;
+}
+
+// The free cluster count comes from FSINFO when FatFs trusts it.
+static uint32_t fat_statfs(drv_fs_t *drv, vfs_statfs_t *st) {
+    FATFS *fs;
+    DWORD free_clusters;
+    memset(st, 0, sizeof(vfs_statfs_t));
+    if(f_getfree(drv->drv_data, &free_clusters, &fs) != FR_OK) return 1;
+    st->block_size = fs->csize * FF_MAX_SS;
+    st->blocks = fs->n_fatent - 2;
+    st->free_blocks = st->avail_blocks = free_clusters;
+    return 0;
+}
+
+// FatFs locks each volume for the duration of a call, the diskio FAT cache
+// and bcache below it have locks of their own. A call only finds a lock
+// taken from an interrupt handler and fails with FR_TIMEOUT.
+static mutex_t fat_locks[FF_VOLUMES];
+
+int ff_cre_syncobj(BYTE vol, FF_SYNC_t *sobj) {
+    *sobj = &fat_locks[vol];
+    mutex_init(*sobj);
+    return 1;
+}
+int ff_req_grant(FF_SYNC_t sobj) {
+    return mutex_trylock(sobj) == 0;
+}
+void ff_rel_grant(FF_SYNC_t sobj) {
+    mutex_unlock(sobj);
+}
+int ff_del_syncobj(FF_SYNC_t sobj) {
+    (void)sobj;
+    return 1;
+}
+
+void drv_fs_fat_init(drv_fs_t *drv) {
+    drv->open = fat_open;
+    drv->resize = fat_resize;
+    drv->read = fat_read;
+    drv->write = fat_write;
+    drv->fstat = fat_fstat;
+    drv->close = fat_close;
+    drv->unlink = fat_unlink;
+    drv->statfs = fat_statfs;
+    drv->reserve = fat_reserve;
+}
@@ -0,0 +1,172 @@
+#include "iso9660.h"
+
+#include "bcache.h"
+#include "drivers.h"
+#include "kernel.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Device sectors per 2048-byte ISO block, images on 512-byte disks work too.
+static uint64_t iso9660_lba(drv_fs_iso9660_data_t *data, uint32_t block) {
+    return (uint64_t)block * (ISO9660_BLOCK_SIZE / data->dev->sector_size);
+}
+static bcache_buf_t *read_block(drv_fs_iso9660_data_t *data, uint32_t block) {
+    return bread(data->dev, iso9660_lba(data, block), ISO9660_BLOCK_SIZE);
+}
+
+static void iso9660_file(const iso9660_dirent_t *de, iso9660_file_t *file) {
+    file->lba = de->extent_lba;
+    file->size = de->size;
+    file->flags = de->flags;
+}
+
+void iso9660_init(drv_fs_iso9660_data_t *data, drv_blk_t *dev) {
+    data->ready = 0;
+    data->dev = dev;
+    if(dev == 0 || dev->sector_size > ISO9660_BLOCK_SIZE) return;
+    // Volume descriptors start at block 16, up to the set terminator.
+    for(uint32_t block = 16; block < 16 + 32; block++) {
+        bcache_buf_t *b = read_block(data, block);
+        if(b == 0) return;
+        iso9660_pvd_t *pvd = (void *)b->data;
+        if(memcmp(pvd->id, "CD001", 5) != 0 || pvd->type == 255) {
+            brelse(b);
+            return;
+        }
+        if(pvd->type == 1 && pvd->block_size == ISO9660_BLOCK_SIZE) {
+            iso9660_file((void *)pvd->root, &data->root);
+            data->volume_blocks = pvd->volume_blocks;
+            memcpy(data->volume_id, pvd->volume_id, 32);
+            uint8_t n = 32;
+            while(n && data->volume_id[n - 1] == ' ') n--;
+            data->volume_id[n] = 0;
+            data->ready = 1;
+            brelse(b);
+            return;
+        }
+        brelse(b);
+    }
+}
+
+// Calls visit for each record of the directory until it returns non-zero.
+static uint8_t iso9660_walk(drv_fs_iso9660_data_t *data,
+                            const iso9660_file_t *dir,
+                            uint8_t (*visit)(const iso9660_dirent_t *de,
+                                             void *arg),
+                            void *arg) {
+    for(uint32_t off = 0; off < dir->size; off += ISO9660_BLOCK_SIZE) {
+        bcache_buf_t *b = read_block(data, dir->lba + off / ISO9660_BLOCK_SIZE);
+        if(b == 0) return 0;
+        uint32_t pos = 0;
+        // Records never cross a block, zero length pads the rest of it.
+        while(pos + 33 < ISO9660_BLOCK_SIZE) {
+            iso9660_dirent_t *de = (void *)(b->data + pos);
+            if(de->length == 0 || pos + de->length > ISO9660_BLOCK_SIZE) break;
+            if(visit(de, arg)) {
+                brelse(b);
+                return 1;
+            }
+            pos += de->length;
+        }
+        brelse(b);
+    }
+    return 0;
+}
+
+// Name without the ";1" version and the trailing dot of extensionless files.
+static uint8_t iso9660_name_len(const iso9660_dirent_t *de) {
+    uint8_t n = de->name_len;
+    for(uint8_t i = 0; i < n; i++)
+        if(de->name[i] == ';') n = i;
+    if(n > 1 && de->name[n - 1] == '.') n--;
+    return n;
+}
+
+static char iso9660_upper(char c) {
+    return (c >= 'a' && c <= 'z') ? (char)(c - 'a' + 'A') : c;
+}
+
+typedef struct {
+    const char *name;
+    uint32_t len;
+    iso9660_file_t *file;
+} iso9660_lookup_t;
+
+static uint8_t iso9660_match(const iso9660_dirent_t *de, void *arg) {
+    iso9660_lookup_t *l = arg;
+    if(de->name_len == 1 && (uint8_t)de->name[0] <= 1) return 0;  // . and ..
+    if(iso9660_name_len(de) != l->len) return 0;
+    for(uint32_t i = 0; i < l->len; i++)
+        if(iso9660_upper(de->name[i]) != iso9660_upper(l->name[i]))
+            return 0;
+    iso9660_file(de, l->file);
+    return 1;
+}
+
+uint8_t iso9660_find(drv_fs_iso9660_data_t *data, const char *path,
+                     iso9660_file_t *file) {
+    if(!data->ready) return 1;
+    *file = data->root;
+    while(*path) {
+        if(*path == '/') {
+            path++;
+            continue;
+        }
+        const char *end = path;
+        while(*end && *end != '/') end++;
+        if(!(file->flags & ISO9660_FLAG_DIR)) return 1;
+        iso9660_file_t dir = *file;
+        iso9660_lookup_t l = {path, (uint32_t)(end - path), file};
+        if(!iso9660_walk(data, &dir, iso9660_match, &l)) return 1;
+        path = end;
+    }
+    return 0;
+}
+
+uint32_t iso9660_read(drv_fs_iso9660_data_t *data, const iso9660_file_t *file,
+                      uint32_t offset, uint8_t *buf, uint32_t len) {
+    if(!data->ready || offset >= file->size) return 0;
+    if(len > file->size - offset) len = file->size - offset;
+    uint32_t done = 0;
+    while(done < len) {
+        uint32_t pos = offset + done, in = pos % ISO9660_BLOCK_SIZE;
+        uint32_t block = file->lba + pos / ISO9660_BLOCK_SIZE;
+        if(in == 0 && len - done >= ISO9660_BLOCK_SIZE) {
+            // Whole blocks go straight to the buffer in one transfer.
+            uint32_t blocks = (len - done) / ISO9660_BLOCK_SIZE;
+            if(blkdev_read(data->dev, iso9660_lba(data, block),
+                           blocks
+                             * (ISO9660_BLOCK_SIZE / data->dev->sector_size),
+                           buf + done))
+                break;
+            done += blocks * ISO9660_BLOCK_SIZE;
+            continue;
+        }
+        bcache_buf_t *b = read_block(data, block);
+        if(b == 0) break;
+        uint32_t n = min(ISO9660_BLOCK_SIZE - in, len - done);
+        memcpy(buf + done, b->data + in, n);
+        brelse(b);
+        done += n;
+    }
+    return done;
+}
+
+static uint8_t iso9660_print(const iso9660_dirent_t *de, void *arg) {
+    (void)arg;
+    if(de->name_len == 1 && (uint8_t)de->name[0] <= 1) return 0;
+    printf("%c %10lu ", (de->flags & ISO9660_FLAG_DIR) ? 'd' : '-', de->size);
+    for(uint8_t i = 0; i < iso9660_name_len(de); i++) printf("%c", de->name[i]);
+    printf("\n");
+    return 0;
+}
+
+void iso9660_print_dir(drv_fs_iso9660_data_t *data, const char *path) {
+    iso9660_file_t dir;
+    if(iso9660_find(data, path, &dir) || !(dir.flags & ISO9660_FLAG_DIR)) {
+        printf("iso9660 %s not found\n", path);
+        return;
+    }
+    iso9660_walk(data, &dir, iso9660_print, 0);
+}
@@ -2,14 +2,21 @@
 #include "arch/cpuid.h"
 #include "arch/intr.h"
 #include "arch/io.h"
+#include "arch/pci.h"
+#include "bcache.h"
 #include "disk.h"
 #include "drivers.h"
+#include "fatfs/diskio.h"
 #include "fatfs/ff.h"
 #include "kernel.h"
+#include "mmap.h"
 #include "multiboot.h"
+#include "pcache.h"
+#include "vfs.h"
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static uint32_t mb_magic, mb_addr, irq0_print = 0;
@@ -57,16 +64,36 @@ drv_pagealloc_data_t malloc_data = {.pts = malloc_tpts,
 drv_mem_t malloc_drv = {.drv_data = &malloc_data, .user_data = 0};
 drv_mem_t *pagealloc_kernel = &malloc_drv;
 
+uint32_t __attribute__((aligned(4096))) pcache_pts[1024];
+uint32_t *pcache_tpts = pcache_pts;
+drv_pagealloc_data_t pcache_mem_data = {.pts = &pcache_tpts,
+                                        .numpts = 1,
+                                        .map = (void *)0xDFC00000,
+                                        .total_range = 0,
+                                        .addr_start = 0xDF800000,
+                                        .flags = 0};
+drv_mem_t pcache_mem = {.drv_data = &pcache_mem_data, .user_data = 0};
+
 drv_fs_ext2_data_t ext2_data;
 drv_fs_exfat_data_t exfat_data;
+drv_fs_iso9660_data_t iso9660_data;
+
+drv_ramdisk_data_t ramdisk_data;
+drv_blk_t ramdisk = {.drv_data = &ramdisk_data, .name = "ram0"};
+static drv_blk_t *root_dev;
 
 static uint8_t multiboot_ok = 0, multiboot_fb_text;
 static uint32_t multiboot_fb_width, multiboot_fb_height, multiboot_fb_bpp,
   multiboot_fb_pitch, multiboot_mem_low, multiboot_mem_high;
 static char *multiboot_cmd, *multiboot_bootloader;
 static void *multiboot_fb;
+static uint32_t multiboot_mod_start, multiboot_mod_end;
 
-FATFS fat_data;
+FATFS fat_data[FF_VOLUMES];
+static char fat_names[FF_VOLUMES][3];
+static uint8_t fat_count = 0;
+static drv_fs_t fs_drv[BLKDEV_MAX], *root_fs = 0;
+static uint8_t fs_count = 0;
 
 void do_irq0(void) {
     static uint16_t i = 0;
@@ -241,12 +268,12 @@ void parse_multiboot(void) {
         case MULTIBOOT_TAG_TYPE_BOOT_LOADER_NAME:
             multiboot_bootloader = ((struct multiboot_tag_string *)tag)->string;
             break;
-        // case MULTIBOOT_TAG_TYPE_MODULE:
-        //     printf ("Module at 0x%x-0x%x. Command line %s\n",
-        //         ((struct multiboot_tag_module *) tag)->mod_start,
-        //         ((struct multiboot_tag_module *) tag)->mod_end,
-        //         ((struct multiboot_tag_module *) tag)->cmdline);
-        //     break;
+        case MULTIBOOT_TAG_TYPE_MODULE:
+            if(multiboot_mod_end) break;
+            multiboot_mod_start
+              = ((struct multiboot_tag_module *)tag)->mod_start;
+            multiboot_mod_end = ((struct multiboot_tag_module *)tag)->mod_end;
+            break;
         case MULTIBOOT_TAG_TYPE_BASIC_MEMINFO:
             multiboot_mem_low
               = ((struct multiboot_tag_basic_meminfo *)tag)->mem_lower;
@@ -307,6 +334,13 @@ void keybord_in(drv_in_t *drv, uint8_t ch, uint16_t flags) {
     if((flags & (IN_SPECIAL_ALT | IN_SPECIAL_CTRL)) == 0 && ch >= ' '
        && ch < IN_KEY_F1) {
         if(ch == 'M') test_multiboot();
+        else if(ch == 'B')
+            bcache_print_stats();
+        else if(ch == 'P')
+            pcache_print_stats();
+        else if(ch == 'F')
+            printf("fat cache hits %lu misses %lu\n", disk_fat_stats.hits,
+                   disk_fat_stats.misses);
         else if(ch == 'C')
             irq0_print = 1;
         else if(ch == 'c')
@@ -338,7 +372,7 @@ void keybord_in(drv_in_t *drv, uint8_t ch, uint16_t flags) {
         else if(ch >= '0' && ch <= '9') {
             uint32_t n = ch - '0' + ((uint32_t *)(mbr + 446))[2];
             printf("reading lba %lu\n", n);
-            ide_read_sectors(0, 1, n, disk_data);
+            blkdev_read(root_dev, n, 1, disk_data);
         } else if(ch == 'T') {
             float x = 1.0;
             x -= 1.0;
@@ -373,6 +407,9 @@ void keybord_in(drv_in_t *drv, uint8_t ch, uint16_t flags) {
                     printf("partition type 0x%02X\n", mbr[446 + 4]);
                     printf("first lba 0x%08lX\n", ((uint32_t *)(mbr + 446))[2]);
                     printf("last lba 0x%08lX\n", ((uint32_t *)(mbr + 446))[3]);
+                } else if(ch == IN_KEY_F9) {
+                    screen0.clear(&screen0);
+                    iso9660_print_dir(&iso9660_data, "/");
                 } else if(ch == IN_KEY_F10) {
                     screen0.clear(&screen0);
                     for(uint16_t i = 0; i < 256; i++) {
@@ -385,6 +422,14 @@ void keybord_in(drv_in_t *drv, uint8_t ch, uint16_t flags) {
                         printf("%02X ", disk_data[i]);
                         if((i % 16) == 15) printf("\n");
                     }
+                } else if(ch == IN_KEY_F4) {
+                    vfs_statfs_t st;
+                    if(vfs_statfs("/", &st) == 0)
+                        printf("block %lu total %lu free %lu avail %lu\n"
+                               "files %lu free %lu longest free run %lu\n",
+                               st.block_size, st.blocks, st.free_blocks,
+                               st.avail_blocks, st.files, st.free_files,
+                               st.max_free_run);
                 } else if(ch == IN_KEY_F5) {
                     screen0.clear(&screen0);
                     ext2_print_sb(&ext2_data);
@@ -442,6 +487,11 @@ static void init_mem(void) {
     malloc_data.total_range = multiboot_mem_high / 4;
     drv_pagealloc_init(&malloc_drv);
     malloc_drv.set_state(&malloc_drv, 1);
+    pcache_mem_data.total_range = multiboot_mem_high / 4;
+    drv_pagealloc_init(&pcache_mem);
+    pcache_mem.set_state(&pcache_mem, 1);
+    pcache_init(&pcache_mem, pcache_mem_data.addr_start);
+    mmap_init();
 }
 static void init_pit(void) {
     // unsigned long val=1193180/hz; 1192 -> 1000Hz
@@ -539,6 +589,47 @@ static void init_uart(void) {
     enable_irq(4);
     write_serial('a');
 }
+static void init_ide(void) {
+    uint8_t bus, slot, func;
+    uint32_t bar4 = 0;
+    // PCI IDE controller (class 01:01) provides Bus Master registers in BAR4.
+    if(pci_find_class(0x01, 0x01, &bus, &slot, &func)) {
+        bar4 = pci_read(bus, slot, func, PCI_REG_BAR4);
+        if(bar4 & 1) {
+            uint32_t cmd = pci_read(bus, slot, func, PCI_REG_COMMAND);
+            pci_write(bus, slot, func, PCI_REG_COMMAND,
+                      cmd | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+        } else
+            bar4 = 0;  // Memory mapped Bus Master is not supported.
+    }
+    ide_initialize(0x1F0, 0x3F6, 0x170, 0x376, (uint16_t)bar4);
+}
+static void init_ramdisk(void) {
+    if(multiboot_mod_end == 0) return;
+    // Only the first 8MB are mapped at 0xC0000000, above that pages belong to
+    // the page allocator.
+    if(multiboot_mod_end > 0x800000) {
+        printf("ramdisk module at 0x%lX-0x%lX not below 8MB\n",
+               multiboot_mod_start, multiboot_mod_end);
+        return;
+    }
+    ramdisk_data.mem = (uint8_t *)(0xC0000000 + multiboot_mod_start);
+    ramdisk_data.bytes = multiboot_mod_end - multiboot_mod_start;
+    drv_ramdisk_init(&ramdisk);
+    blkdev_register(&ramdisk);
+    printf("ramdisk %luKB\n", ramdisk_data.bytes / 1024);
+}
+static void init_cdrom(void) {
+    for(uint8_t i = 0; i < BLKDEV_MAX; i++) {
+        drv_blk_t *dev = blkdev_get(i);
+        if(dev == 0 || dev->sector_size != 2048) continue;
+        iso9660_init(&iso9660_data, dev);
+        if(iso9660_data.ready) {
+            printf("iso9660 %s on %s\n", iso9660_data.volume_id, dev->name);
+            return;
+        }
+    }
+}
 static void init_kbd(void) {
     kbd.in_clb = keybord_in;
     drv_kbd_init(&kbd);
@@ -575,6 +666,72 @@ FRESULT scan_files(char *path) {
     return res;
 }
 
+// Mounts the ext2 or FAT filesystem on dev at path.
+static drv_fs_t *mount_fs(drv_blk_t *dev, const char *path) {
+    if(fs_count == BLKDEV_MAX) return 0;
+    drv_fs_t *fs = &fs_drv[fs_count];
+    drv_fs_ext2_data_t *ext2 = ext2_data.ready
+                                 ? malloc(sizeof(drv_fs_ext2_data_t))
+                                 : &ext2_data;
+    if(ext2) ext2_init(ext2, dev, 0);
+    if(ext2 && ext2->ready) {
+        fs->drv_data = ext2;
+        drv_fs_ext2_init(fs);
+    } else {
+        if(ext2 != &ext2_data) free(ext2);
+        ext2 = 0;
+        if(fat_count == FF_VOLUMES) return 0;
+        sprintf(fat_names[fat_count], "%u:", fat_count);
+        disk_attach(fat_count, dev);
+        if(f_mount(&fat_data[fat_count], fat_names[fat_count], 1) != FR_OK) {
+            disk_attach(fat_count, 0);
+            return 0;
+        }
+        FATFS *fat = &fat_data[fat_count];
+        disk_set_fat(fat_count, fat->fatbase, fat->fsize * fat->n_fats);
+        fs->drv_data = fat_names[fat_count++];
+        drv_fs_fat_init(fs);
+    }
+    if(vfs_mount(path, fs)) {
+        // Nothing may keep pointing at a filesystem that isn't mounted.
+        if(ext2) {
+            ext2_release(ext2);
+            if(ext2 != &ext2_data) free(ext2);
+        } else {
+            fat_count--;
+            f_mount(0, fat_names[fat_count], 0);
+            disk_attach(fat_count, 0);
+        }
+        return 0;
+    }
+    fs_count++;
+    printf("%s mounted at %s\n", dev->name, path);
+    return fs;
+}
+// Mounts every partition, and whole disks without a partition table. The
+// first filesystem on the boot device becomes the root, the others appear
+// under their device name.
+static void init_volumes(void) {
+    uint8_t parted[BLKDEV_MAX];
+    char path[24];
+    // Partitions are registered behind the existing devices.
+    for(uint8_t i = 0; i < BLKDEV_MAX; i++)
+        parted[i] = part_scan(blkdev_get(i)) > 0;
+    for(uint8_t pass = 0; pass < 2; pass++) {
+        for(uint8_t i = 0; i < BLKDEV_MAX; i++) {
+            drv_blk_t *dev = blkdev_get(i), *whole = part_parent(dev);
+            if(dev == 0 || parted[i] || dev->sector_size != 512) continue;
+            if((pass == 0) != ((whole ? whole : dev) == root_dev)) continue;
+            if(root_fs == 0) {
+                root_fs = mount_fs(dev, "/");
+                if(root_fs) continue;
+            }
+            snprintf(path, sizeof(path), "/%s", dev->name);
+            mount_fs(dev, path);
+        }
+    }
+}
+
 void start_kernel(uint32_t magic, uint32_t addr) {
     mb_magic = magic;
     mb_addr = addr;
@@ -598,34 +755,25 @@ void start_kernel(uint32_t magic, uint32_t addr) {
     enable_irq(2);
     asm("sti");
     printf("irq %02X %02X\n", inb(0x21), inb(0xA1));
-    ide_initialize(0x1F0, 0x3F6, 0x170, 0x376, 0x000);
-    ide_read_sectors(0, 1, 0, mbr);
-    if(mbr[446 + 4] == 0x83)
-        ext2_init(&ext2_data, ((uint32_t *)(mbr + 446))[2]);
-    else {
-        printf("fat_mount %u\n", f_mount(&fat_data, "0:", 1));
+    init_ide();
+    init_ramdisk();
+    init_cdrom();
+    root_dev = blkdev_find("ram0");
+    if(root_dev == 0) root_dev = blkdev_find("hda");
+    if(root_dev == 0 || blkdev_read(root_dev, 0, 1, mbr)) {
+        printf("no root device\n");
+        goto fs_err;
+    }
+    init_volumes();
+    // The FAT root is always volume 0, it gets the old test file append.
+    if(root_fs && root_fs->drv_data == fat_names[0]) {
         char buff[256];
         strcpy(buff, "0:");
         scan_files(buff);
-        FATFS *fs;
-        uint32_t fre_clust, fre_sect, tot_sect;
-        f_getfree("0:", &fre_clust, &fs);
-        // Get total sectors and free sectors
-        tot_sect = (fs->n_fatent - 2) * fs->csize;
-        fre_sect = fre_clust * fs->csize;
-
-        // Print the free space (assuming 512 bytes/sector)
-        printf("%10lu KiB total drive space.\n%10lu KiB available.\n",
-               tot_sect / 2, fre_sect / 2);
-
-        FIL fil;
-        UINT written;
-        FRESULT res
-          = f_open(&fil, "0:/test.txt", FA_READ | FA_WRITE | FA_OPEN_APPEND);
-        if(res) goto fs_err;
-        f_write(&fil, "abcd\n", 5, &written);
-        printf("written %u\n", written);
-        f_close(&fil);
+        FILE *f = fopen("/test.txt", "a");
+        if(f == 0) goto fs_err;
+        printf("written %d\n", fprintf(f, "abcd\n"));
+        fclose(f);
     }
 fs_err:
     printf("hello sin(0.25)=%f\n", sin(0.25));
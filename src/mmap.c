@@ -0,0 +1,108 @@
+#include "mmap.h"
+
+#include "arch/io.h"
+#include "vfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MMAP_END (MMAP_BASE + MMAP_PTS * 0x400000u)
+
+typedef struct {
+    uint32_t addr;  // 0 when the slot is free.
+    uint32_t pages;
+    int32_t fd;
+    uint32_t index;  // File page at addr.
+    pcache_page_t **present;  // Mapped page cache pages, one per page.
+} mmap_area_t;
+
+static uint32_t __attribute__((aligned(4096))) mmap_pts[MMAP_PTS][1024];
+static mmap_area_t mmap_areas[MMAP_MAX];
+
+void mmap_init(void) {
+    for(uint8_t i = 0; i < MMAP_PTS; i++)
+        pt_set_entry((void *)0xFFFFF000, (uint16_t)((MMAP_BASE >> 22) + i),
+                     get_physaddr((uint32_t)mmap_pts[i]), 0, 1, 1);
+}
+
+// Lowest free address with room for pages, 0 when there is none.
+static uint32_t mmap_find_range(uint32_t pages) {
+    uint32_t addr = MMAP_BASE, bytes = pages * PCACHE_PAGE;
+    uint8_t moved = 1;
+    while(moved) {
+        moved = 0;
+        if(bytes > MMAP_END - addr) return 0;
+        for(uint8_t i = 0; i < MMAP_MAX; i++) {
+            mmap_area_t *a = &mmap_areas[i];
+            uint32_t end = a->addr + a->pages * PCACHE_PAGE;
+            if(a->addr && a->addr < addr + bytes && addr < end) {
+                addr = end;
+                moved = 1;
+            }
+        }
+    }
+    return addr;
+}
+
+static mmap_area_t *mmap_area(uint32_t addr) {
+    for(uint8_t i = 0; i < MMAP_MAX; i++) {
+        mmap_area_t *a = &mmap_areas[i];
+        if(a->addr && addr >= a->addr
+           && addr - a->addr < a->pages * PCACHE_PAGE)
+            return a;
+    }
+    return 0;
+}
+
+void *mmap_file(int32_t fd, uint32_t offset, uint32_t len) {
+    uint32_t mode, size;
+    if(len == 0 || len > MMAP_END - MMAP_BASE || offset % PCACHE_PAGE
+       || vfs_fstat(fd, &mode, &size) < 0)
+        return 0;
+    mmap_area_t *a = 0;
+    for(uint8_t i = 0; i < MMAP_MAX && a == 0; i++)
+        if(mmap_areas[i].addr == 0) a = &mmap_areas[i];
+    uint32_t pages = (len + PCACHE_PAGE - 1) / PCACHE_PAGE,
+             addr = mmap_find_range(pages);
+    if(a == 0 || addr == 0) return 0;
+    a->present = calloc(pages, sizeof(pcache_page_t *));
+    if(a->present == 0) return 0;
+    a->addr = addr;
+    a->pages = pages;
+    a->fd = fd;
+    a->index = offset / PCACHE_PAGE;
+    return (void *)addr;
+}
+
+uint8_t mmap_unmap(void *addr) {
+    mmap_area_t *a = mmap_area((uint32_t)addr);
+    if(a == 0 || a->addr != (uint32_t)addr) return 1;
+    for(uint32_t n = 0; n < a->pages; n++)
+        if(a->present[n])
+            pcache_unmap(a->present[n], a->addr + n * PCACHE_PAGE);
+    free(a->present);
+    a->addr = 0;
+    return 0;
+}
+
+// Demand paging: a read of a not yet present page in a mapped area maps
+// the cached file page, everything else is fatal. So is a fault from inside
+// a filesystem driver, which would be entered again to fetch the page.
+void do_exc14(uint32_t arg) {
+    uint32_t addr = read_cr2();
+    mmap_area_t *a = mmap_area(addr);
+    if(a && (arg & 3) == 0 && !vfs_busy) {
+        uint32_t n = (addr - a->addr) / PCACHE_PAGE;
+        pcache_page_t *page = vfs_getpage(a->fd, a->index + n);
+        if(page && pcache_map(page, addr & ~0xFFFu, 0) == 0) {
+            a->present[n] = page;
+            return;
+        }
+        pcache_put(page);
+    }
+    write_serial('@');
+    write_serial('a' + 14);
+    printf("pf %08lX at %08lX%s\n", arg, addr, vfs_busy ? " in vfs" : "");
+    ((uint16_t *)0xC00B8000)[0] = 0x0F00 | '@';
+    while(1) asm("hlt;");
+}
@@ -0,0 +1,16 @@
+#include "mutex.h"
+
+void mutex_init(mutex_t *m) {
+    m->locked = 0;
+}
+
+uint8_t mutex_trylock(mutex_t *m) {
+    uint32_t old = 1;
+    __asm__ volatile("xchg %0, %1" : "+r"(old), "+m"(m->locked)::"memory");
+    return (uint8_t)old;
+}
+
+void mutex_unlock(mutex_t *m) {
+    __asm__ volatile("" ::: "memory");
+    m->locked = 0;
+}
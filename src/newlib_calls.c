@@ -1,9 +1,12 @@
 #include "arch/io.h"
 #include "kernel.h"
+#include "vfs.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #undef errno
@@ -11,12 +14,18 @@ extern int errno;
 
 #define UNUSED(x) (void)(x)
 
+// Turns a negative errno from the VFS into the newlib convention.
+static int vfs_ret(int32_t ret) {
+    if(ret >= 0) return ret;
+    errno = -ret;
+    return -1;
+}
+
 void _exit(void) { asm("cli\n .loop: hlt\n jmp .loop"); }
 
 int close(int file) {
-    printf("close %u\n", file);
-    UNUSED(file);
-    return -1;
+    if(file <= 2) return 0;
+    return vfs_ret(vfs_close(file));
 }
 
 char *__env[1] = {0};
@@ -36,20 +45,26 @@ int fork(void) {
 }
 
 int fstat(int file, struct stat *st) {
-    printf("fstat %u\n", file);
-    UNUSED(file);
-    UNUSED(st);
-    st->st_mode = S_IFCHR;
+    uint32_t mode, size;
+    // newlib's stdio reads st_blksize and friends, unset fields must be 0.
+    memset(st, 0, sizeof *st);
+    if(file >= 0 && file <= 2) {
+        st->st_mode = S_IFCHR;
+        return 0;
+    }
+    int32_t ret = vfs_fstat(file, &mode, &size);
+    if(ret < 0) return vfs_ret(ret);
+    st->st_mode = mode;
+    st->st_size = size;
     return 0;
 }
 
 int getpid(void) { return 1; }
 
 int isatty(int file) {
-    printf("isatty %u\n", file);
-    UNUSED(file);
-    if(file <= 2) return 1;
-    return 1;
+    if(file >= 0 && file <= 2) return 1;
+    errno = ENOTTY;
+    return 0;
 }
 
 int kill(int pid, int sig) {
@@ -67,27 +82,35 @@ int link(char *old, char *new) {
 }
 
 int lseek(int file, int ptr, int dir) {
-    printf("lseek %u\n", file);
-    UNUSED(file);
-    UNUSED(ptr);
-    UNUSED(dir);
-    return 0;
+    if(file >= 0 && file <= 2) return 0;
+    uint8_t whence;
+    switch(dir) {
+    case SEEK_SET: whence = VFS_SEEK_SET; break;
+    case SEEK_CUR: whence = VFS_SEEK_CUR; break;
+    case SEEK_END: whence = VFS_SEEK_END; break;
+    default: errno = EINVAL; return -1;
+    }
+    return vfs_ret(vfs_lseek(file, ptr, whence));
 }
 
-int open(const char *name, int flags, int mode) {
-    printf("open %s\n", name);
-    UNUSED(name);
-    UNUSED(flags);
-    UNUSED(mode);
-    return -1;
+// newlib declares open variadic, the mode of O_CREAT is not used.
+int open(const char *name, int flags, ...) {
+    uint32_t vflags = 0;
+    switch(flags & O_ACCMODE) {
+    case O_RDONLY: vflags = VFS_O_READ; break;
+    case O_WRONLY: vflags = VFS_O_WRITE; break;
+    default: vflags = VFS_O_READ | VFS_O_WRITE; break;
+    }
+    if(flags & O_CREAT) vflags |= VFS_O_CREATE;
+    if(flags & O_TRUNC) vflags |= VFS_O_TRUNC;
+    if(flags & O_APPEND) vflags |= VFS_O_APPEND;
+    return vfs_ret(vfs_open(name, vflags));
 }
 
 int read(int file, char *ptr, int len) {
-    printf("read %u\n", file);
-    UNUSED(file);
-    UNUSED(ptr);
-    UNUSED(len);
-    return 0;
+    // No console input yet, stdin is always at end of file.
+    if(file >= 0 && file <= 2) return 0;
+    return vfs_ret(vfs_read(file, ptr, (uint32_t)len));
 }
 
 void *sbrk(unsigned int incr) {
@@ -110,18 +133,16 @@ void *sbrk(unsigned int incr) {
 }
 
 int stat(const char *file, struct stat *st) {
-    printf("stat %s\n", file);
-    UNUSED(file);
-    UNUSED(st);
-    st->st_mode = S_IFCHR;
+    uint32_t mode, size;
+    memset(st, 0, sizeof *st);
+    int32_t ret = vfs_stat(file, &mode, &size);
+    if(ret < 0) return vfs_ret(ret);
+    st->st_mode = mode;
+    st->st_size = size;
     return 0;
 }
 
-int unlink(char *name) {
-    UNUSED(name);
-    errno = ENOENT;
-    return -1;
-}
+int unlink(char *name) { return vfs_ret(vfs_unlink(name)); }
 
 int wait(int *status) {
     UNUSED(status);
@@ -136,7 +157,7 @@ int write(int file, char *ptr, int len) {
             if(inout_kernel) inout_kernel->out->ch(inout_kernel->out, ptr[i]);
             if(ptr[i] == '\n') write_serial('\r');
         }
-    } else
-        printf("write %u\n", file);
+    } else if(file != 0)
+        return vfs_ret(vfs_write(file, ptr, (uint32_t)len));
     return len;
 }
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include "pcache.h"
+
+#include "arch/io.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define PCACHE_HASH_BITS 7
+
+static pcache_page_t pcache_pages[PCACHE_PAGES];
+static pcache_page_t *pcache_hash[1 << PCACHE_HASH_BITS];
+// Most recently used page at lru.next, least recently used at lru.prev.
+static pcache_page_t pcache_lru = {.prev = &pcache_lru, .next = &pcache_lru};
+static drv_mem_t *pcache_mem = 0;
+static uint32_t pcache_base;
+pcache_stats_t pcache_stats;
+
+static void pcache_lru_insert(pcache_page_t *p) {
+    p->prev = &pcache_lru;
+    p->next = pcache_lru.next;
+    pcache_lru.next->prev = p;
+    pcache_lru.next = p;
+}
+static void pcache_lru_touch(pcache_page_t *p) {
+    p->prev->next = p->next;
+    p->next->prev = p->prev;
+    pcache_lru_insert(p);
+}
+
+void pcache_init(drv_mem_t *mem, uint32_t base) {
+    pcache_mem = mem;
+    pcache_base = base;
+    for(uint32_t i = 0; i < PCACHE_PAGES; i++)
+        pcache_lru_insert(&pcache_pages[i]);
+}
+
+static pcache_page_t **pcache_bucket(drv_fs_t *fs, uint32_t file,
+                                     uint32_t index) {
+    uint32_t key = index ^ (file * 31) ^ (uint32_t)fs;
+    return &pcache_hash[(key * 2654435761u) >> (32 - PCACHE_HASH_BITS)];
+}
+static void pcache_unhash(pcache_page_t *p) {
+    pcache_page_t **b = pcache_bucket(p->fs, p->file, p->index);
+    while(*b != p) b = &(*b)->hnext;
+    *b = p->hnext;
+    p->fs = 0;
+}
+
+// Returns a referenced page holding bytes index * PCACHE_PAGE onwards of
+// the file, reading it through fs on a miss. Returns 0 if that read fails.
+pcache_page_t *pcache_get(drv_fs_t *fs, uint32_t file, uint32_t index) {
+    if(pcache_mem == 0) return 0;
+    pcache_page_t **bucket = pcache_bucket(fs, file, index), *p;
+    for(p = *bucket; p; p = p->hnext)
+        if(p->fs == fs && p->file == file && p->index == index) {
+            p->refs++;
+            pcache_lru_touch(p);
+            pcache_stats.hits++;
+            return p;
+        }
+    pcache_stats.misses++;
+    for(p = pcache_lru.prev; p != &pcache_lru && p->refs; p = p->prev)
+        ;
+    if(p == &pcache_lru) return 0;
+    if(p->fs) pcache_unhash(p);
+    if(p->data == 0) {
+        void *addr
+          = (void *)(pcache_base + (uint32_t)(p - pcache_pages) * PCACHE_PAGE);
+        if(pcache_mem->alloc(pcache_mem, addr, 1) != addr) return 0;
+        p->data = addr;
+    }
+    // read returns 0 on errors as well as at EOF, only a read that stops at
+    // the end of the file is complete.
+    uint32_t offset = index * PCACHE_PAGE, mode, size, want = 0;
+    p->len = fs->read(fs, file, offset, p->data, PCACHE_PAGE);
+    if(fs->fstat(fs, file, &mode, &size)) return 0;
+    if(size > offset)
+        want = size - offset < PCACHE_PAGE ? size - offset : PCACHE_PAGE;
+    if(p->len != want) return 0;
+    memset(p->data + p->len, 0, PCACHE_PAGE - p->len);
+    p->fs = fs;
+    p->file = file;
+    p->index = index;
+    p->refs = 1;
+    p->hnext = *bucket;
+    *bucket = p;
+    pcache_lru_touch(p);
+    return p;
+}
+void pcache_put(pcache_page_t *page) {
+    if(page) page->refs--;
+}
+
+uint8_t pcache_map(pcache_page_t *page, uint32_t addr, uint8_t user) {
+    uint32_t *pd = (uint32_t *)0xFFFFF000;
+    if((pd[addr >> 22] & 1) == 0) return 1;
+    uint32_t *pt = ((uint32_t *)0xFFC00000) + (0x400 * (addr >> 22));
+    pt_set_entry(pt, (uint16_t)(addr >> 12 & 0x3FF),
+                 get_physaddr((uint32_t)page->data), user, 0, 1);
+    invlpg(addr);
+    return 0;
+}
+void pcache_unmap(pcache_page_t *page, uint32_t addr) {
+    uint32_t *pt = ((uint32_t *)0xFFC00000) + (0x400 * (addr >> 22));
+    pt_set_entry(pt, (uint16_t)(addr >> 12 & 0x3FF), 0, 0, 0, 0);
+    invlpg(addr);
+    pcache_put(page);
+}
+
+// Copies a write of len bytes at offset into the cached pages it covers, so
+// mappings see it.
+void pcache_update(drv_fs_t *fs, uint32_t file, uint32_t offset,
+                   const uint8_t *buf, uint32_t len) {
+    uint32_t end = offset + len;
+    for(uint32_t i = 0; i < PCACHE_PAGES && len; i++) {
+        pcache_page_t *p = &pcache_pages[i];
+        if(p->fs != fs || p->file != file) continue;
+        uint32_t start = p->index * PCACHE_PAGE, stop = start + PCACHE_PAGE;
+        if(start >= end || stop <= offset) continue;
+        uint32_t s = start > offset ? start : offset,
+                 e = stop < end ? stop : end;
+        memcpy(p->data + (s - start), buf + (s - offset), e - s);
+        if(e - start > p->len) p->len = e - start;
+    }
+}
+void pcache_truncate(drv_fs_t *fs, uint32_t file, uint32_t size) {
+    for(uint32_t i = 0; i < PCACHE_PAGES; i++) {
+        pcache_page_t *p = &pcache_pages[i];
+        if(p->fs != fs || p->file != file) continue;
+        uint32_t start = p->index * PCACHE_PAGE;
+        if(start >= size) {
+            pcache_unhash(p);
+            continue;
+        }
+        // Growing only extends the zero tail, shrinking clears it again.
+        uint32_t len = size - start < PCACHE_PAGE ? size - start : PCACHE_PAGE;
+        if(len < p->len) memset(p->data + len, 0, p->len - len);
+        p->len = len;
+    }
+}
+// Referenced pages stay mapped but can no longer be found.
+void pcache_drop(drv_fs_t *fs, uint32_t file) {
+    for(uint32_t i = 0; i < PCACHE_PAGES; i++)
+        if(pcache_pages[i].fs == fs && pcache_pages[i].file == file)
+            pcache_unhash(&pcache_pages[i]);
+}
+
+void pcache_print_stats(void) {
+    printf("pcache hits %lu misses %lu\n", pcache_stats.hits,
+           pcache_stats.misses);
+}
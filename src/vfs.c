@@ -1,3 +1,269 @@
+#include "vfs.h"
+
 #include "kernel.h"
 
-#include <stdio.h>
\ No newline at end of file
+#include <errno.h>
+#include <string.h>
+
+typedef struct {
+    char path[VFS_PATH];  // Normalized, "" for the root.
+    uint32_t len;
+    drv_fs_t *fs;  // 0 when the slot is free.
+} vfs_mount_t;
+
+static vfs_mount_t vfs_mounts[VFS_MOUNTS];
+static vfs_fdtable_t vfs_kernel_fds;
+vfs_fdtable_t *vfs_fds = &vfs_kernel_fds;
+uint8_t vfs_busy = 0;
+
+// Absolute path without empty, "." and ".." components and without the
+// trailing slash, the root becomes "". Relative paths start at the root.
+static uint8_t vfs_normalize(const char *path, char *out) {
+    uint32_t len = 0;
+    while(*path) {
+        if(*path == '/') {
+            path++;
+            continue;
+        }
+        const char *end = path;
+        while(*end && *end != '/') end++;
+        uint32_t n = (uint32_t)(end - path);
+        if(n == 2 && path[0] == '.' && path[1] == '.') {
+            while(len && out[len - 1] != '/') len--;
+            if(len) len--;
+        } else if(n != 1 || path[0] != '.') {
+            if(len + 1 + n >= VFS_PATH) return 1;
+            out[len++] = '/';
+            memcpy(out + len, path, n);
+            len += n;
+        }
+        path = end;
+    }
+    out[len] = 0;
+    return 0;
+}
+
+// Mount with the longest prefix of path ending on a component boundary,
+// rest receives the remaining path inside it.
+static vfs_mount_t *vfs_find_mount(const char *path, const char **rest) {
+    vfs_mount_t *best = 0;
+    for(uint8_t i = 0; i < VFS_MOUNTS; i++) {
+        vfs_mount_t *m = &vfs_mounts[i];
+        if(m->fs == 0 || strncmp(path, m->path, m->len) != 0) continue;
+        if(path[m->len] != 0 && path[m->len] != '/') continue;
+        if(best == 0 || m->len > best->len) best = m;
+    }
+    if(best) *rest = *(path + best->len) ? path + best->len : "/";
+    return best;
+}
+
+uint8_t vfs_mount(const char *path, drv_fs_t *fs) {
+    char norm[VFS_PATH];
+    if(fs == 0 || vfs_normalize(path, norm)) return 1;
+    vfs_mount_t *free_slot = 0;
+    for(uint8_t i = 0; i < VFS_MOUNTS; i++) {
+        if(vfs_mounts[i].fs == 0) {
+            if(free_slot == 0) free_slot = &vfs_mounts[i];
+        } else if(strcmp(vfs_mounts[i].path, norm) == 0)
+            return 2;
+    }
+    if(free_slot == 0) return 3;
+    strcpy(free_slot->path, norm);
+    free_slot->len = strlen(norm);
+    free_slot->fs = fs;
+    return 0;
+}
+uint8_t vfs_umount(const char *path) {
+    char norm[VFS_PATH];
+    if(vfs_normalize(path, norm)) return 1;
+    for(uint8_t i = 0; i < VFS_MOUNTS; i++) {
+        vfs_mount_t *m = &vfs_mounts[i];
+        if(m->fs == 0 || strcmp(m->path, norm) != 0) continue;
+        // Busy while any descriptor still uses it.
+        for(uint8_t fd = 0; fd < VFS_FDS; fd++)
+            if(vfs_fds->files[fd].fs == m->fs) return 2;
+        m->fs = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static vfs_file_t *vfs_file(int32_t fd) {
+    if(fd < 3 || fd >= VFS_FDS || vfs_fds->files[fd].fs == 0) return 0;
+    return &vfs_fds->files[fd];
+}
+
+int32_t vfs_open(const char *path, uint32_t flags) {
+    char norm[VFS_PATH];
+    const char *rest;
+    if(vfs_normalize(path, norm)) return -ENAMETOOLONG;
+    vfs_mount_t *m = vfs_find_mount(norm, &rest);
+    if(m == 0) return -ENOENT;
+    if((flags & (VFS_O_WRITE | VFS_O_CREATE | VFS_O_TRUNC))
+       && m->fs->write == 0)
+        return -EROFS;
+    int32_t fd = 3;
+    while(fd < VFS_FDS && vfs_fds->files[fd].fs) fd++;
+    if(fd == VFS_FDS) return -EMFILE;
+    uint32_t code = m->fs->open(m->fs, rest, flags);
+    if(code == 0) return -ENOENT;
+    vfs_file_t *f = &vfs_fds->files[fd];
+    f->code = code;
+    f->fs = m->fs;
+    f->mode = flags;
+    f->offset = 0;
+    if(flags & VFS_O_TRUNC) pcache_truncate(f->fs, code, 0);
+    return fd;
+}
+
+int32_t vfs_create(const char *path, uint32_t flags, uint32_t size) {
+    int32_t fd
+      = vfs_open(path, flags | VFS_O_WRITE | VFS_O_CREATE | VFS_O_TRUNC);
+    if(fd < 0 || size == 0) return fd;
+    vfs_file_t *f = &vfs_fds->files[fd];
+    uint32_t err = f->fs->reserve ? f->fs->reserve(f->fs, f->code, size) : 1;
+    // Without a contiguous run the file is grown the usual way.
+    if(err && f->fs->resize) err = f->fs->resize(f->fs, f->code, size);
+    if(err) {
+        vfs_close(fd);
+        return -ENOSPC;
+    }
+    return fd;
+}
+
+int32_t vfs_read(int32_t fd, void *buf, uint32_t len) {
+    vfs_file_t *f = vfs_file(fd);
+    if(f == 0 || !(f->mode & VFS_O_READ)) return -EBADF;
+    uint8_t *dst = buf;
+    uint32_t n = 0;
+    vfs_busy = 1;
+    // Served from the page cache, so reads and mappings share the pages.
+    while(n < len) {
+        uint32_t pos = f->offset + n, off = pos % PCACHE_PAGE;
+        pcache_page_t *p = pcache_get(f->fs, f->code, pos / PCACHE_PAGE);
+        if(p == 0) {
+            // No cache or no free page, the rest goes to the driver.
+            n += f->fs->read(f->fs, f->code, pos, dst + n, len - n);
+            break;
+        }
+        uint32_t c = p->len > off ? p->len - off : 0;
+        if(c > len - n) c = len - n;
+        memcpy(dst + n, p->data + off, c);
+        n += c;
+        uint32_t end = p->len;
+        pcache_put(p);
+        if(end < PCACHE_PAGE && off + c >= end) break;
+    }
+    vfs_busy = 0;
+    f->offset += n;
+    return (int32_t)n;
+}
+int32_t vfs_write(int32_t fd, const void *buf, uint32_t len) {
+    vfs_file_t *f = vfs_file(fd);
+    if(f == 0 || !(f->mode & VFS_O_WRITE)) return -EBADF;
+    if(f->mode & VFS_O_APPEND) {
+        uint32_t mode, size;
+        if(f->fs->fstat(f->fs, f->code, &mode, &size)) return -EIO;
+        f->offset = size;
+    }
+    // Fault in a source mapped from a file now, not inside the driver.
+    uint32_t first = (uint32_t)buf, last = first + len - 1;
+    for(uint32_t a = first; len && a <= last; a = (a | (PCACHE_PAGE - 1)) + 1)
+        (void)*(const volatile uint8_t *)a;
+    vfs_busy = 1;
+    uint32_t n = f->fs->write(f->fs, f->code, f->offset, buf, len);
+    pcache_update(f->fs, f->code, f->offset, buf, n);
+    vfs_busy = 0;
+    f->offset += n;
+    if(n == 0 && len) return -ENOSPC;
+    return (int32_t)n;
+}
+
+int32_t vfs_lseek(int32_t fd, int32_t offset, uint8_t whence) {
+    vfs_file_t *f = vfs_file(fd);
+    if(f == 0) return -EBADF;
+    int64_t base = 0;
+    if(whence == VFS_SEEK_CUR) base = f->offset;
+    else if(whence == VFS_SEEK_END) {
+        uint32_t mode, size;
+        if(f->fs->fstat(f->fs, f->code, &mode, &size)) return -EIO;
+        base = size;
+    } else if(whence != VFS_SEEK_SET)
+        return -EINVAL;
+    if(base + offset < 0 || base + offset > 0x7FFFFFFF) return -EINVAL;
+    f->offset = (uint32_t)(base + offset);
+    return (int32_t)f->offset;
+}
+
+int32_t vfs_ftruncate(int32_t fd, uint32_t size) {
+    vfs_file_t *f = vfs_file(fd);
+    if(f == 0 || !(f->mode & VFS_O_WRITE)) return -EBADF;
+    if(f->fs->resize == 0) return -EROFS;
+    if(f->fs->resize(f->fs, f->code, size)) return -EIO;
+    pcache_truncate(f->fs, f->code, size);
+    return 0;
+}
+
+int32_t vfs_fstat(int32_t fd, uint32_t *mode, uint32_t *size) {
+    vfs_file_t *f = vfs_file(fd);
+    if(f == 0) return -EBADF;
+    return f->fs->fstat(f->fs, f->code, mode, size) ? -EIO : 0;
+}
+int32_t vfs_stat(const char *path, uint32_t *mode, uint32_t *size) {
+    int32_t fd = vfs_open(path, VFS_O_READ);
+    if(fd < 0) return fd;
+    int32_t err = vfs_fstat(fd, mode, size);
+    vfs_close(fd);
+    return err;
+}
+
+int32_t vfs_close(int32_t fd) {
+    vfs_file_t *f = vfs_file(fd);
+    if(f == 0) return -EBADF;
+    uint32_t err = f->fs->close(f->fs, f->code);
+    drv_fs_t *fs = f->fs;
+    f->fs = 0;
+    // Cached pages live as long as some descriptor has the file open.
+    uint8_t shared = 0;
+    for(uint8_t i = 3; i < VFS_FDS; i++)
+        if(vfs_fds->files[i].fs == fs && vfs_fds->files[i].code == f->code)
+            shared = 1;
+    if(!shared) pcache_drop(fs, f->code);
+    return err ? -EIO : 0;
+}
+
+int32_t vfs_statfs(const char *path, vfs_statfs_t *st) {
+    char norm[VFS_PATH];
+    const char *rest;
+    if(vfs_normalize(path, norm)) return -ENAMETOOLONG;
+    vfs_mount_t *m = vfs_find_mount(norm, &rest);
+    if(m == 0) return -ENOENT;
+    if(m->fs->statfs == 0) return -ENOSYS;
+    return m->fs->statfs(m->fs, st) ? -EIO : 0;
+}
+
+pcache_page_t *vfs_getpage(int32_t fd, uint32_t index) {
+    vfs_file_t *f = vfs_file(fd);
+    if(f == 0 || !(f->mode & VFS_O_READ)) return 0;
+    return pcache_get(f->fs, f->code, index);
+}
+
+int32_t vfs_unlink(const char *path) {
+    char norm[VFS_PATH];
+    const char *rest;
+    if(vfs_normalize(path, norm)) return -ENAMETOOLONG;
+    vfs_mount_t *m = vfs_find_mount(norm, &rest);
+    if(m == 0) return -ENOENT;
+    if(m->fs->unlink == 0) return -EROFS;
+    // Handles like ext2 inode numbers would dangle, open files stay linked.
+    uint32_t code = m->fs->open(m->fs, rest, VFS_O_READ);
+    if(code) {
+        uint8_t busy = 0;
+        for(uint8_t i = 3; i < VFS_FDS; i++)
+            if(vfs_fds->files[i].fs == m->fs && vfs_fds->files[i].code == code)
+                busy = 1;
+        m->fs->close(m->fs, code);
+        if(busy) return -EBUSY;
+    }
+    return m->fs->unlink(m->fs, rest) ? -ENOENT : 0;
+}